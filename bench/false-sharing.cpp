@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <string>
+
+#include "cactus-plus.hpp"
+
+/* Each owner thread repeatedly pushes an async child frame on top
+ * of a parent frame and forks it off to its thief thread. Then,
+ * for the whole round, the owner writes to the last word of the
+ * parent frame while the thief writes to the first word of the
+ * child frame, after which the thief pops the child, which
+ * decrements the refcount in the header of the shared chunk. The
+ * parent frame is sized such that, without cache-line alignment,
+ * the two words share a line: every write of one thread then
+ * invalidates the line in the cache of the other. With alignment,
+ * the child starts on a line of its own. The program prints
+ * whether the two words share a line, along with the running time.
+ * The difference in time shows only when the owner and the thief
+ * of a pair run on different cores; compare false-sharing and
+ * false-sharing-aligned, or count the coherence misses of each
+ * one with a profiler, e.g., perf c2c.
+ */
+
+namespace cactus_stack {
+  namespace plus {
+
+    class frame {
+    public:
+      volatile size_t v;
+    };
+
+    class mailbox {
+    public:
+      std::atomic<bool> full;
+      // set by the owner and by the thief as they start writing
+      std::atomic<int> nb_started;
+      stack_type s;
+      // keeps the mailboxes of different pairs on different lines
+      char pad[cache_line_szb];
+    };
+
+    auto is_splittable_fn = [] (char*) {
+      return false;
+    };
+
+    /* Size of the parent frame that puts its last word on the same
+     * line as the first word of a child pushed right above it,
+     * when frames are laid out without alignment. The parent is
+     * the first frame of its chunk, and chunks are aligned on K.
+     */
+    size_t parent_szb() {
+      size_t lo = sizeof(chunk_header_type) + sizeof(frame_header_type);
+      size_t szb = sizeof(frame);
+      auto line = [] (size_t off) {
+        return off / cache_line_szb;
+      };
+      while (line(lo + szb - sizeof(frame)) != line(lo + szb + sizeof(frame_header_type))) {
+        szb += sizeof(frame);
+      }
+      return szb;
+    }
+
+    bool same_line(void* a, void* b) {
+      return ((uintptr_t)a / cache_line_szb) == ((uintptr_t)b / cache_line_szb);
+    }
+
+    void write(frame* f, size_t nb_writes) {
+      for (size_t i = 0; i < nb_writes; i++) {
+        f->v = f->v + 1;
+      }
+    }
+
+    // waits for the other thread of the pair to start its writes
+    void start(mailbox& mb, int round) {
+      mb.nb_started.fetch_add(1);
+      while (mb.nb_started.load() < 2 * (round + 1)) {
+        std::this_thread::yield();
+      }
+    }
+
+    void owner(mailbox& mb, size_t nb_rounds, size_t nb_writes, std::atomic<int>* nb_same_line) {
+      size_t szb = parent_szb();
+      stack_type s = push_back(create_stack(), szb, Parent_link_sync, [&] (char* p) {
+        new (p + szb - sizeof(frame)) frame;
+        ((frame*)(p + szb - sizeof(frame)))->v = 0;
+      }, is_splittable_fn);
+      frame* parent = (frame*)(frame_data(s.fp) + szb - sizeof(frame));
+      for (size_t r = 0; r < nb_rounds; r++) {
+        s = push_back<sizeof(frame)>(s, Parent_link_async, [&] (char* p) {
+          new (p) frame;
+          ((frame*)p)->v = 0;
+        }, is_splittable_fn);
+        if ((r == 0) && same_line(parent, frame_data(s.fp))) {
+          nb_same_line->fetch_add(1);
+        }
+        auto ss = fork_mark(s, is_splittable_fn);
+        mb.s = ss.second;
+        mb.full.store(true);
+        start(mb, (int)r);
+        write(parent, nb_writes);
+        while (mb.full.load()) {
+          std::this_thread::yield();
+        }
+        s = join_mark(ss.first, mb.s);
+      }
+      destroy_stack(s);
+    }
+
+    void thief(mailbox& mb, size_t nb_rounds, size_t nb_writes) {
+      for (size_t r = 0; r < nb_rounds; r++) {
+        while (! mb.full.load()) {
+          std::this_thread::yield();
+        }
+        stack_type s = mb.s;
+        start(mb, (int)r);
+        write(frame_data<frame>(s.fp), nb_writes);
+        s = pop_back(s, [] (char*, shared_frame_type) { });
+        mb.s = s;
+        mb.full.store(false);
+      }
+    }
+
+  } // end namespace
+} // end namespace
+
+int main(int argc, const char * argv[]) {
+  using namespace cactus_stack::plus;
+  size_t nb_pairs = (argc > 1) ? std::stoul(argv[1]) : 1;
+  size_t nb_rounds = (argc > 2) ? std::stoul(argv[2]) : 1000;
+  size_t nb_writes = (argc > 3) ? std::stoul(argv[3]) : 100000;
+  std::vector<mailbox> mbs(nb_pairs);
+  for (auto& mb : mbs) {
+    mb.full.store(false);
+    mb.nb_started.store(0);
+  }
+  std::atomic<int> nb_same_line(0);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < nb_pairs; i++) {
+    threads.emplace_back(owner, std::ref(mbs[i]), nb_rounds, nb_writes, &nb_same_line);
+    threads.emplace_back(thief, std::ref(mbs[i]), nb_rounds, nb_writes);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "cache_align " << cache_align << std::endl;
+  std::cout << "same_line " << nb_same_line.load() << "/" << nb_pairs << std::endl;
+  std::cout << "exectime " << elapsed.count() << std::endl;
+  return 0;
+}
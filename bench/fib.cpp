@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <string>
+
+#include "cactus-runtime.hpp"
+
+/* Computes fib(n) by naive parallel recursion, with no cutoff, to
+ * measure the cost of spawning and joining. The "cactus" mode uses
+ * the runtime of cactus-runtime.hpp. The "deque" mode is a baseline
+ * in which each worker has a deque shared with the thieves, which
+ * protect it by a lock.
+ *
+ *   fib <cactus|deque> n nb_workers polling_interval [hierarchical|richest]
+ */
+
+namespace cactus {
+
+  using namespace cactus_stack::runtime;
+
+  class fib : public frame {
+  public:
+
+    int n;
+    long* dst;
+    long a, b;
+    int state = 0;
+
+    fib(int n, long* dst)
+      : n(n), dst(dst) { }
+
+    void run(worker& w) override {
+      switch (state) {
+        case 0: {
+          if (n < 2) {
+            *dst = n;
+            w.finish();
+            return;
+          }
+          state = 1;
+          w.spawn<fib>(n - 1, &a);
+          return;
+        }
+        case 1: {
+          state = 2;
+          w.call<fib>(n - 2, &b);
+          return;
+        }
+        case 2: {
+          state = 3;
+          w.sync();
+          return;
+        }
+        case 3: {
+          *dst = a + b;
+          w.finish();
+          return;
+        }
+      }
+    }
+
+  };
+
+  long run(int n, config_type config) {
+    long r;
+    auto stats = launch<fib>(config, n, &r);
+    std::cout << "nb_steals " << stats.nb_steals << std::endl;
+    std::cout << "nb_rejected " << stats.nb_rejected << std::endl;
+    std::cout << "nb_parks " << stats.nb_parks << std::endl;
+    for (int l = 0; l < nb_topology_levels; l++) {
+      std::cout << "nb_steals_at_level_" << l << " " << stats.nb_steals_at_level[l] << std::endl;
+    }
+    return r;
+  }
+
+} // end namespace
+
+namespace deque {
+
+  class task {
+  public:
+    int n;
+    long* dst;
+    std::atomic<int>* join;
+  };
+
+  class worker_deque {
+  public:
+    std::mutex lock;
+    std::deque<task> tasks;
+  };
+
+  std::vector<worker_deque>* deques;
+
+  std::atomic<bool> done;
+
+  thread_local int my_id;
+
+  thread_local unsigned int rng;
+
+  bool pop(task& t) {
+    auto& d = (*deques)[my_id];
+    std::lock_guard<std::mutex> g(d.lock);
+    if (d.tasks.empty()) {
+      return false;
+    }
+    t = d.tasks.back();
+    d.tasks.pop_back();
+    return true;
+  }
+
+  bool steal(task& t) {
+    int nb = (int)deques->size();
+    if (nb == 1) {
+      return false;
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    int v = (int)(rng % (unsigned int)nb);
+    if (v == my_id) {
+      return false;
+    }
+    auto& d = (*deques)[v];
+    std::lock_guard<std::mutex> g(d.lock);
+    if (d.tasks.empty()) {
+      return false;
+    }
+    t = d.tasks.front();
+    d.tasks.pop_front();
+    return true;
+  }
+
+  void fib(int n, long* dst);
+
+  void run_task(const task& t) {
+    fib(t.n, t.dst);
+    t.join->fetch_sub(1, std::memory_order_release);
+  }
+
+  void fib(int n, long* dst) {
+    if (n < 2) {
+      *dst = n;
+      return;
+    }
+    long a, b;
+    std::atomic<int> join(1);
+    {
+      auto& d = (*deques)[my_id];
+      std::lock_guard<std::mutex> g(d.lock);
+      d.tasks.push_back({ n - 1, &a, &join });
+    }
+    fib(n - 2, &b);
+    task t;
+    if ((join.load(std::memory_order_acquire) != 0) && pop(t)) {
+      run_task(t);
+    }
+    while (join.load(std::memory_order_acquire) != 0) {
+      if (pop(t) || steal(t)) {
+        run_task(t);
+      }
+    }
+    *dst = a + b;
+  }
+
+  void worker(int id) {
+    my_id = id;
+    rng = 1 + id;
+    task t;
+    while (! done.load(std::memory_order_relaxed)) {
+      if (steal(t)) {
+        run_task(t);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  long run(int n, int nb_workers) {
+    std::vector<worker_deque> ds(nb_workers);
+    deques = &ds;
+    done.store(false);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nb_workers; i++) {
+      threads.emplace_back(worker, i);
+    }
+    my_id = 0;
+    rng = 1;
+    long r;
+    fib(n, &r);
+    done.store(true);
+    for (auto& t : threads) {
+      t.join();
+    }
+    return r;
+  }
+
+} // end namespace
+
+int main(int argc, const char * argv[]) {
+  std::string mode = (argc > 1) ? argv[1] : "cactus";
+  int n = (argc > 2) ? std::stoi(argv[2]) : 30;
+  auto config = cactus_stack::runtime::default_config();
+  if (argc > 3) {
+    config.nb_workers = std::stoi(argv[3]);
+  }
+  if (argc > 4) {
+    config.polling_interval = std::stoi(argv[4]);
+  }
+  if ((argc > 5) && (std::string(argv[5]) == "hierarchical")) {
+    config.victim_selection = cactus_stack::runtime::Victim_hierarchical;
+    config.pin_workers = true;
+  }
+  if ((argc > 5) && (std::string(argv[5]) == "richest")) {
+    config.victim_selection = cactus_stack::runtime::Victim_richest;
+  }
+  auto start = std::chrono::steady_clock::now();
+  long r;
+  if (mode == "cactus") {
+    r = cactus::run(n, config);
+  } else {
+    r = deque::run(n, config.nb_workers);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "result " << r << std::endl;
+  std::cout << "exectime " << elapsed.count() << std::endl;
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <sys/resource.h>
+
+#include "cactus-fiber.hpp"
+
+/* Runs many sessions at once, each one as a fiber that, a number of
+ * times, calls a handler frame, which yields to the other sessions
+ * before it returns. Reports the running time and the peak resident
+ * set size, which grows with the number of chunks that the fibers
+ * hold, one each here, rather than with the size of native stacks.
+ *
+ *   fibers nb_sessions nb_rounds
+ */
+
+namespace cactus_stack {
+  namespace fiber {
+
+    class handler : public frame {
+    public:
+
+      long* counter;
+      int state = 0;
+
+      handler(long* counter)
+        : counter(counter) { }
+
+      void run(scheduler& sc) override {
+        switch (state) {
+          case 0: {
+            state = 1;
+            sc.yield();
+            return;
+          }
+          case 1: {
+            (*counter)++;
+            sc.finish();
+            return;
+          }
+        }
+      }
+
+    };
+
+    class session : public frame {
+    public:
+
+      int nb_rounds;
+      long* counter;
+      int i = 0;
+
+      session(int nb_rounds, long* counter)
+        : nb_rounds(nb_rounds), counter(counter) { }
+
+      void run(scheduler& sc) override {
+        if (i == nb_rounds) {
+          sc.finish();
+          return;
+        }
+        i++;
+        sc.call<handler>(counter);
+      }
+
+    };
+
+  } // end namespace
+} // end namespace
+
+int main(int argc, const char * argv[]) {
+  using namespace cactus_stack::fiber;
+  long nb_sessions = (argc > 1) ? std::stol(argv[1]) : 100000;
+  int nb_rounds = (argc > 2) ? std::stoi(argv[2]) : 100;
+  long counter = 0;
+  auto start = std::chrono::steady_clock::now();
+  {
+    scheduler sc;
+    for (long i = 0; i < nb_sessions; i++) {
+      sc.spawn<session>(nb_rounds, &counter);
+    }
+    sc.run();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  std::cout << "result " << counter << std::endl;
+  std::cout << "exectime " << elapsed.count() << std::endl;
+  std::cout << "max_rss_kb " << ru.ru_maxrss << std::endl;
+  return 0;
+}
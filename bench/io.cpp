@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cactus-runtime.hpp"
+
+/* Writes a file of nb_blocks blocks, one frame per block, then reads
+ * it back in the same way, checking each block. Each frame starts its
+ * write or read with worker::write or worker::read. The reads and
+ * writes go through the reactor, or, when the queue depth is zero,
+ * block the worker that starts them.
+ *
+ *   io path nb_blocks nb_workers io_queue_depth
+ */
+
+namespace cactus_stack {
+  namespace runtime {
+
+    static constexpr
+    int block_szb = 1024;
+
+    int fd;
+
+    std::atomic<long> nb_errors(0);
+
+    class block : public frame {
+    public:
+
+      int i;
+      bool write;
+      int state = 0;
+      int res = 0;
+      char buf[block_szb];
+
+      block(int i, bool write)
+        : i(i), write(write) { }
+
+      void run(worker& w) override {
+        switch (state) {
+          case 0: {
+            state = 1;
+            if (write) {
+              memset(buf, 'a' + (i % 26), block_szb);
+              w.write(fd, buf, block_szb, (uint64_t)i * block_szb, &res);
+            } else {
+              w.read(fd, buf, block_szb, (uint64_t)i * block_szb, &res);
+            }
+            return;
+          }
+          case 1: {
+            if ((res != block_szb) || (buf[block_szb - 1] != 'a' + (i % 26))) {
+              nb_errors++;
+            }
+            w.finish();
+            return;
+          }
+        }
+      }
+
+    };
+
+    class blocks : public frame {
+    public:
+
+      int lo, hi;
+      bool write;
+      int state = 0;
+
+      blocks(int lo, int hi, bool write)
+        : lo(lo), hi(hi), write(write) { }
+
+      void run(worker& w) override {
+        switch (state) {
+          case 0: {
+            if (hi - lo == 1) {
+              state = 3;
+              w.call<block>(lo, write);
+              return;
+            }
+            state = 1;
+            w.spawn<blocks>(lo, (lo + hi) / 2, write);
+            return;
+          }
+          case 1: {
+            state = 2;
+            w.call<blocks>((lo + hi) / 2, hi, write);
+            return;
+          }
+          case 2: {
+            state = 3;
+            w.sync();
+            return;
+          }
+          case 3: {
+            w.finish();
+            return;
+          }
+        }
+      }
+
+    };
+
+  } // end namespace
+} // end namespace
+
+int main(int argc, const char * argv[]) {
+  using namespace cactus_stack::runtime;
+  std::string path = (argc > 1) ? argv[1] : "io-bench.dat";
+  int nb_blocks = (argc > 2) ? std::stoi(argv[2]) : 100000;
+  auto config = default_config();
+  if (argc > 3) {
+    config.nb_workers = std::stoi(argv[3]);
+  }
+  if (argc > 4) {
+    config.io_queue_depth = std::stoi(argv[4]);
+  }
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "cannot open " << path << std::endl;
+    return 1;
+  }
+  auto start = std::chrono::steady_clock::now();
+  launch<blocks>(config, 0, nb_blocks, true);
+  launch<blocks>(config, 0, nb_blocks, false);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  close(fd);
+  unlink(path.c_str());
+  std::cout << "nb_errors " << nb_errors.load() << std::endl;
+  std::cout << "exectime " << elapsed.count() << std::endl;
+  return (nb_errors.load() == 0) ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <cmath>
+
+#include "cactus-runtime.hpp"
+
+/* Computes C = A * B for n x n matrices of doubles. The "blocked"
+ * mode runs a 2-D blocked_loop_frame over the tiles of C, of b x b
+ * entries, each tile being computed by blocks of b along the inner
+ * dimension. The "rows" mode is a baseline in which a 1-D
+ * loop_frame hands out the rows of C.
+ *
+ *   matmul <blocked|rows> n nb_workers b
+ */
+
+using namespace cactus_stack::runtime;
+
+class matrices {
+public:
+
+  size_t n;
+
+  std::vector<double> a, b, c;
+
+  matrices(size_t n)
+    : n(n), a(n * n), b(n * n), c(n * n, 0.0) {
+    for (size_t i = 0; i < n * n; i++) {
+      a[i] = (double)(i % 7) - 3.0;
+      b[i] = (double)(i % 5) - 2.0;
+    }
+  }
+
+};
+
+class blocked_matmul : public blocked_loop_frame<blocked_matmul, 2> {
+public:
+
+  matrices* m;
+
+  size_t bk;
+
+  blocked_matmul(matrices* m, size_t bs)
+    : blocked_loop_frame<blocked_matmul, 2>({{ 0, 0 }}, {{ m->n, m->n }}, {{ bs, bs }}),
+      m(m), bk(bs) { }
+
+  void body(const index_type& tlo, const index_type& thi) {
+    size_t n = m->n;
+    const double* a = m->a.data();
+    const double* b = m->b.data();
+    double* c = m->c.data();
+    for (size_t k0 = 0; k0 < n; k0 += bk) {
+      size_t k1 = std::min(k0 + bk, n);
+      for (size_t i = tlo[0]; i < thi[0]; i++) {
+        for (size_t k = k0; k < k1; k++) {
+          double x = a[i * n + k];
+          for (size_t j = tlo[1]; j < thi[1]; j++) {
+            c[i * n + j] += x * b[k * n + j];
+          }
+        }
+      }
+    }
+  }
+
+};
+
+class rows_matmul : public loop_frame<rows_matmul> {
+public:
+
+  matrices* m;
+
+  rows_matmul(matrices* m)
+    : loop_frame<rows_matmul>(0, m->n), m(m) { }
+
+  void body(size_t i) {
+    size_t n = m->n;
+    const double* a = m->a.data();
+    const double* b = m->b.data();
+    double* c = m->c.data();
+    for (size_t k = 0; k < n; k++) {
+      double x = a[i * n + k];
+      for (size_t j = 0; j < n; j++) {
+        c[i * n + j] += x * b[k * n + j];
+      }
+    }
+  }
+
+};
+
+// checks a few entries of c against a naive dot product
+bool check(const matrices& m) {
+  size_t n = m.n;
+  for (size_t s = 0; s < 16; s++) {
+    size_t i = (s * 7919) % n;
+    size_t j = (s * 104729) % n;
+    double x = 0.0;
+    for (size_t k = 0; k < n; k++) {
+      x += m.a[i * n + k] * m.b[k * n + j];
+    }
+    if (std::abs(x - m.c[i * n + j]) > 1e-6) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, const char * argv[]) {
+  std::string mode = (argc > 1) ? argv[1] : "blocked";
+  size_t n = (argc > 2) ? std::stoul(argv[2]) : 1024;
+  auto config = default_config();
+  if (argc > 3) {
+    config.nb_workers = std::stoi(argv[3]);
+  }
+  size_t bs = (argc > 4) ? std::stoul(argv[4]) : 64;
+  matrices m(n);
+  auto start = std::chrono::steady_clock::now();
+  stats_type stats;
+  if (mode == "blocked") {
+    stats = launch<blocked_matmul>(config, &m, bs);
+  } else {
+    stats = launch<rows_matmul>(config, &m);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "nb_splits " << stats.nb_splits << std::endl;
+  std::cout << "check " << (check(m) ? "ok" : "FAILED") << std::endl;
+  std::cout << "exectime " << elapsed.count() << std::endl;
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "cactus-runtime.hpp"
+
+/* Sums a function of the indices of a parallel loop. The "reduce"
+ * mode accumulates privately in each piece of the loop, by
+ * reduce_frame. The "atomic" mode is a baseline in which every
+ * iteration adds to a single shared atomic counter.
+ *
+ *   reduce <reduce|atomic> n nb_workers grain
+ */
+
+using namespace cactus_stack::runtime;
+
+static inline
+long f(size_t i) {
+  return (long)((i * 2654435761u) % 1024);
+}
+
+class sum_reduce : public reduce_frame<sum_reduce, long> {
+public:
+
+  sum_reduce(size_t lo, size_t hi, long* dst, size_t grain)
+    : reduce_frame<sum_reduce, long>(lo, hi, 0, dst, grain) { }
+
+  void body(size_t i) {
+    acc += f(i);
+  }
+
+};
+
+std::atomic<long> total;
+
+class sum_atomic : public loop_frame<sum_atomic> {
+public:
+
+  sum_atomic(size_t lo, size_t hi, size_t grain)
+    : loop_frame<sum_atomic>(lo, hi, grain) { }
+
+  void body(size_t i) {
+    total.fetch_add(f(i), std::memory_order_relaxed);
+  }
+
+};
+
+int main(int argc, const char * argv[]) {
+  std::string mode = (argc > 1) ? argv[1] : "reduce";
+  size_t n = (argc > 2) ? std::stoul(argv[2]) : 100000000;
+  auto config = default_config();
+  if (argc > 3) {
+    config.nb_workers = std::stoi(argv[3]);
+  }
+  size_t grain = (argc > 4) ? std::stoul(argv[4]) : 1024;
+  auto start = std::chrono::steady_clock::now();
+  long r = 0;
+  stats_type stats;
+  if (mode == "reduce") {
+    stats = launch<sum_reduce>(config, 0, n, &r, grain);
+  } else {
+    total.store(0);
+    stats = launch<sum_atomic>(config, 0, n, grain);
+    r = total.load();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "nb_splits " << stats.nb_splits << std::endl;
+  std::cout << "result " << r << std::endl;
+  std::cout << "exectime " << elapsed.count() << std::endl;
+  return 0;
+}
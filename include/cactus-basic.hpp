@@ -47,6 +47,8 @@ namespace cactus_stack {
         std::atomic<int> refcount;
         struct frame_header_struct* sp;
         struct frame_header_struct* lp;
+        // set once a forked-off stack may begin in the middle of this chunk
+        bool forked;
       };
       
       using chunk_type = struct {
@@ -72,6 +74,7 @@ namespace cactus_stack {
         c->hdr.refcount.store(1);
         c->hdr.sp = sp;
         c->hdr.lp = lp;
+        c->hdr.forked = false;
         return c;
       }
       
@@ -234,6 +237,40 @@ namespace cactus_stack {
       Parent_link_async, Parent_link_sync
     };
 
+    namespace {
+
+      /* Fills in the header of the frame t.fp, which has just been
+       * placed on top of the frame pred, and appends the frame to
+       * the mark list of t if it is an async frame.
+       */
+      stack_type link_back(stack_type t, frame_header_type* pred, parent_link_type ty) {
+        frame_header_ext_type fhe;
+        switch (ty) {
+          case Parent_link_async: {
+            fhe.clt = Call_link_async;
+            fhe.pred = t.mtl;
+            fhe.succ = nullptr;
+            if (t.mtl != nullptr) {
+              t.mtl->ext.succ = t.fp;
+            }
+            t.mtl = t.fp;
+            if (t.mhd == nullptr) {
+              t.mhd = t.mtl;
+            }
+            break;
+          }
+          case Parent_link_sync: {
+            fhe.clt = Call_link_sync;
+            break;
+          }
+        }
+        t.fp->pred = pred;
+        t.fp->ext = fhe;
+        return t;
+      }
+
+    } // end namespace
+
     template <int frame_szb, class Initialize_fn>
     stack_type push_back(stack_type s, parent_link_type ty, const Initialize_fn& initialize_fn) {
       stack_type t = s;
@@ -248,29 +285,7 @@ namespace cactus_stack {
         t.lp = (frame_header_type*)((char*)c + K);
       }
       initialize_fn(frame_data(t.fp));
-      frame_header_ext_type fhe;
-      switch (ty) {
-        case Parent_link_async: {
-          fhe.clt = Call_link_async;
-          fhe.pred = s.mtl;
-          fhe.succ = nullptr;
-          if (s.mtl != nullptr) {
-            s.mtl->ext.succ = t.fp;
-          }
-          t.mtl = t.fp;
-          if (t.mhd == nullptr) {
-            t.mhd = t.mtl;
-          }
-          break;
-        }
-        case Parent_link_sync: {
-          fhe.clt = Call_link_sync;
-          break;
-        }
-      }
-      t.fp->pred = s.fp;
-      t.fp->ext = fhe;
-      return t;
+      return link_back(t, s.fp, ty);
     }
     
     template <class Destruct_fn>
@@ -296,9 +311,130 @@ namespace cactus_stack {
         t.lp = cfp->hdr.lp;
         decr_refcount(cfp);
       }
+      if (t.fp == nullptr) {
+        // the region saved in the bottom chunk of a forked-off stack
+        // belongs to the stack that it was forked from
+        t.sp = nullptr;
+        t.lp = nullptr;
+      }
       return t;
     }
-    
+
+    /* Replaces the top frame of s by a new frame, as pop_back
+     * followed by push_back would, but reuses the memory of the
+     * top frame when the new frame fits in the space between the
+     * top frame and the limit of the current allocation region.
+     */
+    template <int frame_szb, class Destruct_fn, class Initialize_fn>
+    stack_type replace_back(stack_type s,
+                            parent_link_type ty,
+                            const Destruct_fn& destruct_fn,
+                            const Initialize_fn& initialize_fn) {
+      assert(! empty(s));
+      auto b = sizeof(frame_header_type) + frame_szb;
+      auto sp = (frame_header_type*)((char*)s.fp + b);
+      if ((s.lp == nullptr) || (sp >= s.lp)) {
+        stack_type t = pop_back(s, destruct_fn);
+        return push_back<frame_szb>(t, ty, initialize_fn);
+      }
+      stack_type t = s;
+      frame_header_type* pred = s.fp->pred;
+      destruct_fn(frame_data(s.fp));
+      if (s.fp == s.mtl) {
+        t = pop_mark_back(t);
+      }
+      t.sp = sp;
+      initialize_fn(frame_data(t.fp));
+      return link_back(t, pred, ty);
+    }
+
+    namespace {
+
+      /* Pops all the frames of s lying above target, which is either
+       * nullptr or a frame of s, calling destruct_fn on each popped
+       * frame only if visit_frames is set. The result is the stack
+       * that the corresponding sequence of pop_back calls would
+       * produce, but each chunk is released by a single refcount
+       * decrement and the mark list is trimmed chunk by chunk.
+       * A frame placed at the start of a chunk that was never
+       * forked is necessarily the bottom-most frame of s in that
+       * chunk, which lets us skip over the chunk in one step when
+       * the frames need not be visited.
+       */
+      template <bool visit_frames, class Destruct_fn>
+      stack_type pop_chunks_until(stack_type s,
+                                  frame_header_type* target,
+                                  const Destruct_fn& destruct_fn) {
+        stack_type t = s;
+        chunk_type* ctarget = chunk_of(target);
+        frame_header_type* fp = s.fp;
+        while (fp != target) {
+          chunk_type* c = chunk_of(fp);
+          if (c == ctarget) {
+            while (fp != target) {
+              frame_header_type* pred = fp->pred;
+              if (visit_frames) {
+                destruct_fn(frame_data(fp));
+              }
+              t.sp = fp;
+              fp = pred;
+            }
+            break;
+          }
+          if (visit_frames || c->hdr.forked) {
+            while (chunk_of(fp) == c) {
+              frame_header_type* pred = fp->pred;
+              if (visit_frames) {
+                destruct_fn(frame_data(fp));
+              }
+              fp = pred;
+            }
+          } else {
+            fp = ((frame_header_type*)chunk_data(c))->pred;
+          }
+          while ((t.mtl != nullptr) && (chunk_of(t.mtl) == c)) {
+            t = pop_mark_back(t);
+          }
+          t.sp = c->hdr.sp;
+          t.lp = c->hdr.lp;
+          decr_refcount(c);
+        }
+        // frames of the same chunk are laid out in stack order
+        while ((t.mtl != nullptr) && (chunk_of(t.mtl) == ctarget) && (t.mtl > target)) {
+          t = pop_mark_back(t);
+        }
+        t.fp = target;
+        if (target == nullptr) {
+          t.sp = nullptr;
+          t.lp = nullptr;
+        }
+        return t;
+      }
+
+    } // end namespace
+
+    template <class Destruct_fn>
+    stack_type pop_until(stack_type s,
+                         frame_header_type* target_fp,
+                         const Destruct_fn& destruct_fn) {
+      return pop_chunks_until<true>(s, target_fp, destruct_fn);
+    }
+
+    // for stacks whose frames are all trivially destructible
+    stack_type pop_until(stack_type s, frame_header_type* target_fp) {
+      return pop_chunks_until<false>(s, target_fp, [] (char*) { });
+    }
+
+    template <class Destruct_fn>
+    void destroy_stack(stack_type s, const Destruct_fn& destruct_fn) {
+      pop_until(s, nullptr, destruct_fn);
+    }
+
+    // for stacks whose frames are all trivially destructible
+    void destroy_stack(stack_type s) {
+      pop_until(s, nullptr);
+    }
+
     std::pair<stack_type, stack_type> fork_mark(stack_type s) {
       stack_type s1 = s;
       stack_type s2 = create_stack();
@@ -323,6 +459,7 @@ namespace cactus_stack {
       chunk_type* cf1 = chunk_of(pf1);
       if (cf1 == chunk_of(pf2)) {
         incr_refcount(cf1);
+        cf1->hdr.forked = true;
       }
       if (chunk_of(s.sp) == cf1) {
         s1.sp = pf2;
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cactus-plus.hpp"
+
+#ifndef _CACTUS_STACK_CHECKPOINT_H_
+#define _CACTUS_STACK_CHECKPOINT_H_
+
+/* Checkpoints a stack to a file, and restores it from there, chunk by
+ * chunk rather than frame by frame. The file holds a header, then a
+ * relocation table, with one entry for each chunk of the stack, which
+ * gives the address of the chunk and the allocation region saved in
+ * its header, and then the frames of each chunk, as they are in
+ * memory. Restoring copies each chunk into a fresh chunk, then, in a
+ * single pass over the frames, translates the links of the frame
+ * headers from old to new addresses, calling a hook on each frame for
+ * the pointers that the frame itself holds into the stack.
+ *
+ * Frames are saved as raw bytes, and the file is thus only meant to
+ * be read back by the same build of the same program, and only if
+ * the frames hold no pointers out of the stack but those that the
+ * hook translates or that stay valid. The vtable pointers of
+ * polymorphic frames, e.g., the ones of cactus-runtime.hpp, and any
+ * other pointers to code or static data are not: under ASLR, each
+ * run of the program loads these at other addresses. Such frames may
+ * be restored only by the process that saved them.
+ *
+ * Checkpoints are not supported in persistent mode, where chunks are
+ * shared between stacks, and hold references on one another. With
+ * join counters, a stack is not saved if one of its frames counts in
+ * a frame of another stack, as the bottom frame of a forked-off
+ * stack does, or waits for children forked off to other stacks: the
+ * copy would be detached from these, which would wait on it, or
+ * which it would wait on, forever.
+ */
+
+namespace cactus_stack {
+  namespace plus {
+
+    /*------------------------------*/
+    /* Checkpoint */
+
+    namespace {
+
+      static constexpr
+      uint64_t checkpoint_magic = 0x6361637475737374; // "cactusst"
+
+      using checkpoint_header_type = struct checkpoint_header_struct {
+        uint64_t magic;
+        uint32_t lg_K;
+        uint32_t frame_header_szb;
+        uint64_t nb_chunks;
+        // fields of the stack, as addresses in the saved chunks
+        uint64_t fp, sp, lp, mhd, mtl;
+        // parallelism summary of the stack
+        int64_t nb_marks, nb_iters;
+      };
+
+      using checkpoint_entry_type = struct checkpoint_entry_struct {
+        // address of the chunk
+        uint64_t base;
+        // allocation region saved in the header of the chunk
+        uint64_t sp, lp;
+        uint64_t forked;
+      };
+
+      static constexpr
+      size_t checkpoint_chunk_szb = K - sizeof(chunk_header_type);
+
+      static inline
+      size_t checkpoint_szb(size_t nb_chunks) {
+        return sizeof(checkpoint_header_type)
+          + nb_chunks * (sizeof(checkpoint_entry_type) + checkpoint_chunk_szb);
+      }
+
+      // chunks of s, from the one of the top frame down
+      static inline
+      std::vector<chunk_type*> chunks_of(stack_type s) {
+        std::vector<chunk_type*> cs;
+        frame_header_type* fp = s.fp;
+        while (fp != nullptr) {
+          chunk_type* c = chunk_of(fp);
+          cs.push_back(c);
+          if (c->hdr.forked) {
+            while ((fp != nullptr) && (chunk_of(fp) == c)) {
+              fp = fp->pred;
+            }
+          } else {
+            // see pop_chunks_until
+            fp = ((frame_header_type*)chunk_data(c))->pred;
+          }
+        }
+        return cs;
+      }
+
+      // true if a frame below fp is linked by its join counter to another stack
+      template <class Header>
+      bool is_joined_out(Header*, std::false_type) {
+        return false;
+      }
+
+      template <class Header>
+      bool is_joined_out(Header* fp, std::true_type) {
+        for (Header* f = fp; f != nullptr; f = f->pred) {
+          if ((f->join_fp != nullptr) || (f->join.load(std::memory_order_acquire) != 0)) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+    } // end namespace
+
+    /* Maps the addresses of a saved stack to the addresses of the
+     * restored one. Addresses that lie outside of the saved chunks,
+     * e.g., of objects on the heap, are left as they are.
+     */
+    class relocation_type {
+    private:
+
+      // address of each saved chunk and of its copy, by saved address
+      std::vector<std::pair<uintptr_t, chunk_type*>> chunks;
+
+    public:
+
+      void add(uint64_t base, chunk_type* c) {
+        chunks.push_back(std::make_pair((uintptr_t)base, c));
+      }
+
+      void sort() {
+        std::sort(chunks.begin(), chunks.end());
+      }
+
+      // the copy of the chunk of the saved address p, if any
+      chunk_type* find(uintptr_t p) const {
+        uintptr_t base = (uintptr_t)chunk_of((char*)p);
+        auto it = std::lower_bound(chunks.begin(), chunks.end(),
+                                   std::make_pair(base, (chunk_type*)nullptr));
+        if ((it == chunks.end()) || (it->first != base)) {
+          return nullptr;
+        }
+        return it->second;
+      }
+
+      template <class T>
+      T* operator()(T* p) const {
+        if (p == nullptr) {
+          return p;
+        }
+        chunk_type* c = find((uintptr_t)p);
+        if (c == nullptr) {
+          return p;
+        }
+        return (T*)((char*)c + ((char*)p - (char*)chunk_of(p)));
+      }
+
+      // same as above, except that addresses outside become nullptr
+      frame_header_type* link(uint64_t p) const {
+        if ((p == 0) || (find((uintptr_t)p) == nullptr)) {
+          return nullptr;
+        }
+        return (*this)((frame_header_type*)(uintptr_t)p);
+      }
+
+    };
+
+    /* Writes the chunks of s to the file at path, which is created or
+     * truncated, through a shared mapping of the file. Frames are
+     * written as they are. Returns false if the file cannot be
+     * written, in persistent mode, and if s is linked to another
+     * stack by a join counter. The stack must not change while it
+     * is written.
+     */
+    static inline
+    bool serialize(stack_type s, const char* path) {
+      if (persistent || is_joined_out(s.fp, join_counter_tag())) {
+        return false;
+      }
+      auto cs = chunks_of(s);
+      size_t szb = checkpoint_szb(cs.size());
+      int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        return false;
+      }
+      if (ftruncate(fd, (off_t)szb) != 0) {
+        close(fd);
+        return false;
+      }
+      void* m = mmap(nullptr, szb, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (m == MAP_FAILED) {
+        close(fd);
+        return false;
+      }
+      auto h = (checkpoint_header_type*)m;
+      h->magic = checkpoint_magic;
+      h->lg_K = lg_K;
+      h->frame_header_szb = sizeof(frame_header_type);
+      h->nb_chunks = cs.size();
+      h->fp = (uint64_t)(uintptr_t)s.fp;
+      h->sp = (uint64_t)(uintptr_t)s.sp;
+      h->lp = (uint64_t)(uintptr_t)s.lp;
+      h->mhd = (uint64_t)(uintptr_t)s.mhd;
+      h->mtl = (uint64_t)(uintptr_t)s.mtl;
+      h->nb_marks = s.par.nb_marks;
+      h->nb_iters = s.par.nb_iters;
+      auto es = (checkpoint_entry_type*)(h + 1);
+      char* d = (char*)(es + cs.size());
+      for (size_t i = 0; i < cs.size(); i++) {
+        chunk_type* c = cs[i];
+        es[i].base = (uint64_t)(uintptr_t)c;
+        es[i].sp = (uint64_t)(uintptr_t)c->hdr.sp;
+        es[i].lp = (uint64_t)(uintptr_t)c->hdr.lp;
+        es[i].forked = c->hdr.forked;
+        memcpy(d + i * checkpoint_chunk_szb, chunk_data(c), checkpoint_chunk_szb);
+      }
+      bool ok = (msync(m, szb, MS_SYNC) == 0);
+      munmap(m, szb);
+      ok = (close(fd) == 0) && ok;
+      return ok;
+    }
+
+    /* Reads back a stack written by serialize, through a private
+     * mapping of the file, into fresh chunks owned by the calling
+     * thread. Calls relocate_fn(_ar, r) on each frame, at its new
+     * address, to let it translate the pointers that it holds into
+     * the stack by r. The bottom frame is restored with no
+     * predecessor. Returns false, along with an empty stack, if the
+     * file cannot be read or was written by another configuration,
+     * and in persistent mode.
+     */
+    template <class Relocate_fn>
+    std::pair<bool, stack_type> restore(const char* path, const Relocate_fn& relocate_fn) {
+      auto failed = std::make_pair(false, create_stack());
+      if (persistent) {
+        return failed;
+      }
+      int fd = open(path, O_RDONLY);
+      if (fd < 0) {
+        return failed;
+      }
+      struct stat st;
+      if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(checkpoint_header_type))) {
+        close(fd);
+        return failed;
+      }
+      size_t szb = (size_t)st.st_size;
+      void* m = mmap(nullptr, szb, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (m == MAP_FAILED) {
+        return failed;
+      }
+      auto h = (const checkpoint_header_type*)m;
+      if ((h->magic != checkpoint_magic) ||
+          (h->lg_K != (uint32_t)lg_K) ||
+          (h->frame_header_szb != sizeof(frame_header_type)) ||
+          (szb != checkpoint_szb(h->nb_chunks))) {
+        munmap(m, szb);
+        return failed;
+      }
+      size_t nb_chunks = h->nb_chunks;
+      auto es = (const checkpoint_entry_type*)(h + 1);
+      const char* d = (const char*)(es + nb_chunks);
+      relocation_type r;
+      std::vector<chunk_type*> cs(nb_chunks);
+      for (size_t i = 0; i < nb_chunks; i++) {
+        chunk_type* c = create_chunk(nullptr, nullptr);
+        memcpy(chunk_data(c), d + i * checkpoint_chunk_szb, checkpoint_chunk_szb);
+        c->hdr.forked = (es[i].forked != 0);
+        r.add(es[i].base, c);
+        cs[i] = c;
+      }
+      r.sort();
+      for (size_t i = 0; i < nb_chunks; i++) {
+        cs[i]->hdr.sp = r.link(es[i].sp);
+        cs[i]->hdr.lp = r.link(es[i].lp);
+      }
+      stack_type s = create_stack();
+      s.fp = r.link(h->fp);
+      s.sp = r.link(h->sp);
+      s.lp = r.link(h->lp);
+      s.mhd = r.link(h->mhd);
+      s.mtl = r.link(h->mtl);
+      s.par.nb_marks = (int)h->nb_marks;
+      s.par.nb_iters = (long)h->nb_iters;
+      munmap(m, szb);
+      auto link = [&] (frame_header_type* p) {
+        return r.link((uint64_t)(uintptr_t)p);
+      };
+      for (frame_header_type* f = s.fp; f != nullptr; f = f->pred) {
+        f->pred = link(f->pred);
+        f->ext.pred = link(f->ext.pred);
+        f->ext.succ = link(f->ext.succ);
+        join_relocate(f, link, join_counter_tag());
+        relocate_fn(frame_data(f), r);
+      }
+      return std::make_pair(true, s);
+    }
+
+    // for stacks whose frames hold no pointers into the stack
+    static inline
+    std::pair<bool, stack_type> restore(const char* path) {
+      return restore(path, [] (char*, const relocation_type&) { });
+    }
+
+    /* Checkpoint */
+    /*------------------------------*/
+
+  } // end namespace
+} // end namespace
+
+#endif /*! _CACTUS_STACK_CHECKPOINT_H_ */
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <utility>
+#include <cstddef>
+#include <assert.h>
+
+/* Fibers are many small stacks, most of which take one chunk, and
+ * chunks allocated one by one take about twice their size. Unless
+ * set otherwise, chunks are thus allocated in slabs. The setting
+ * has no effect where cactus-plus.hpp is included before this file.
+ */
+#ifndef CACTUS_STACK_CHUNKS_PER_SLAB
+#define CACTUS_STACK_CHUNKS_PER_SLAB 16
+#endif
+
+#include "cactus-plus.hpp"
+
+#ifndef _CACTUS_STACK_FIBER_H_
+#define _CACTUS_STACK_FIBER_H_
+
+/* Cooperative fibers, each of which keeps its execution state in a
+ * cactus stack of its own, rather than in a native stack. As in
+ * cactus-runtime.hpp, a frame is an object deriving from frame,
+ * placed in a frame of the cactus stack, and the scheduler
+ * repeatedly calls the run method of the frame on top of the stack
+ * of the current fiber, which, each time, does one step: it calls a
+ * child frame, pops itself with finish, or gives the processor up
+ * with yield or suspend. A fiber thus takes memory in proportion to
+ * the frames that it has, one chunk at least, plus a small handle.
+ * Chunks are allocated in slabs, so a fiber whose frames fit in one
+ * chunk takes K bytes, plus about 100 for its handle.
+ *
+ * A scheduler and its fibers belong to a single thread. Destroying
+ * the scheduler destroys the fibers that are left, suspended ones
+ * included.
+ */
+
+namespace cactus_stack {
+  namespace fiber {
+
+    class scheduler;
+
+    /*------------------------------*/
+    /* Frame */
+
+    class frame {
+    public:
+
+      virtual ~frame() { }
+
+      virtual void run(scheduler& sc) = 0;
+
+    };
+
+    namespace {
+
+      auto is_splittable_fn = [] (char*) {
+        return false;
+      };
+
+      auto destruct_fn = [] (char* p, plus::shared_frame_type) {
+        ((frame*)p)->~frame();
+      };
+
+    } // end namespace
+
+    /* Frame */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Fiber */
+
+    using fiber_state_type = enum fiber_state_enum {
+      // in the ready queue, or, for the current fiber, to be put back there
+      Fiber_ready,
+      Fiber_running,
+      Fiber_suspended
+    };
+
+    class fiber {
+    private:
+
+      friend class scheduler;
+
+      plus::stack_type s;
+
+      fiber_state_type state;
+
+      // neighbors in the ready queue, or in the list of suspended fibers
+      fiber* prev;
+      fiber* next;
+
+      fiber(plus::stack_type s)
+        : s(s), state(Fiber_ready), prev(nullptr), next(nullptr) { }
+
+    public:
+
+      fiber_state_type get_state() const {
+        return state;
+      }
+
+    };
+
+    /* Fiber */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Scheduler */
+
+    class scheduler {
+    private:
+
+      // ready queue
+      fiber* head = nullptr;
+      fiber* tail = nullptr;
+
+      fiber* current = nullptr;
+
+      // fibers that suspended, and that are not resumed yet
+      fiber* suspended = nullptr;
+
+      // number of fibers that have not finished yet
+      size_t nb_fibers = 0;
+
+      void push_ready(fiber* f) {
+        f->next = nullptr;
+        if (tail == nullptr) {
+          head = f;
+        } else {
+          tail->next = f;
+        }
+        tail = f;
+      }
+
+      fiber* pop_ready() {
+        fiber* f = head;
+        head = f->next;
+        if (head == nullptr) {
+          tail = nullptr;
+        }
+        return f;
+      }
+
+      void push_suspended(fiber* f) {
+        f->prev = nullptr;
+        f->next = suspended;
+        if (suspended != nullptr) {
+          suspended->prev = f;
+        }
+        suspended = f;
+      }
+
+      void remove_suspended(fiber* f) {
+        if (f->prev == nullptr) {
+          suspended = f->next;
+        } else {
+          f->prev->next = f->next;
+        }
+        if (f->next != nullptr) {
+          f->next->prev = f->prev;
+        }
+      }
+
+      frame* top() {
+        return plus::frame_data<frame>(current->s.fp);
+      }
+
+      void delete_fiber(fiber* f) {
+        plus::destroy_stack(f->s, destruct_fn);
+        delete f;
+        nb_fibers--;
+      }
+
+    public:
+
+      scheduler() = default;
+
+      scheduler(const scheduler&) = delete;
+
+      scheduler& operator=(const scheduler&) = delete;
+
+      ~scheduler() {
+        while (head != nullptr) {
+          delete_fiber(pop_ready());
+        }
+        while (suspended != nullptr) {
+          fiber* f = suspended;
+          remove_suspended(f);
+          delete_fiber(f);
+        }
+        assert(nb_fibers == 0);
+      }
+
+      /* Creates a fiber whose stack holds a frame of type F, and
+       * appends it to the ready queue. The fiber is deleted once the
+       * frame finishes.
+       */
+      template <class F, class ... Args>
+      fiber* spawn(Args&& ... args) {
+        auto s = plus::create_stack<sizeof(F)>(plus::Parent_link_sync, [&] (char* p) {
+          new (p) F(std::forward<Args>(args)...);
+        }, is_splittable_fn);
+        fiber* f = new fiber(s);
+        nb_fibers++;
+        push_ready(f);
+        return f;
+      }
+
+      // pushes a child frame on the stack of the current fiber
+      template <class F, class ... Args>
+      void call(Args&& ... args) {
+        assert(current != nullptr);
+        current->s = plus::push_back<sizeof(F)>(current->s, plus::Parent_link_sync, [&] (char* p) {
+          new (p) F(std::forward<Args>(args)...);
+        }, is_splittable_fn);
+      }
+
+      // pops the frame on top of the stack of the current fiber
+      void finish() {
+        assert(current != nullptr);
+        current->s = plus::pop_back(current->s, destruct_fn);
+      }
+
+      /* Sends the current fiber to the back of the ready queue once
+       * the current step returns.
+       */
+      void yield() {
+        assert(current != nullptr);
+        current->state = Fiber_ready;
+      }
+
+      /* Takes the current fiber off the scheduler once the current
+       * step returns, until resume is called on it.
+       */
+      fiber* suspend() {
+        assert(current != nullptr);
+        current->state = Fiber_suspended;
+        return current;
+      }
+
+      void resume(fiber* f) {
+        assert(f->state == Fiber_suspended);
+        f->state = Fiber_ready;
+        if (f != current) {
+          remove_suspended(f);
+          push_ready(f);
+        }
+      }
+
+      // pops all the frames of a suspended fiber and deletes it
+      void destroy(fiber* f) {
+        assert((f != current) && (f->state == Fiber_suspended));
+        remove_suspended(f);
+        delete_fiber(f);
+      }
+
+      fiber* self() {
+        return current;
+      }
+
+      size_t get_nb_fibers() const {
+        return nb_fibers;
+      }
+
+      /* Runs fibers from the ready queue until it is empty. A fiber
+       * runs until it yields, suspends or finishes its bottom frame.
+       */
+      void run() {
+        while (head != nullptr) {
+          current = pop_ready();
+          current->state = Fiber_running;
+          do {
+            top()->run(*this);
+          } while ((current->state == Fiber_running) && ! plus::empty(current->s));
+          if (plus::empty(current->s)) {
+            delete_fiber(current);
+          } else if (current->state == Fiber_ready) {
+            push_ready(current);
+          } else {
+            push_suspended(current);
+          }
+          current = nullptr;
+        }
+      }
+
+    };
+
+    /* Scheduler */
+    /*------------------------------*/
+
+  } // end namespace
+} // end namespace
+
+#endif /*! _CACTUS_STACK_FIBER_H_ */
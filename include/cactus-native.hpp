@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <assert.h>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#if defined(__SANITIZE_ADDRESS__)
+#define CACTUS_STACK_NATIVE_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CACTUS_STACK_NATIVE_ASAN 1
+#endif
+#endif
+#ifdef CACTUS_STACK_NATIVE_ASAN
+#include <sanitizer/common_interface_defs.h>
+#include <sanitizer/asan_interface.h>
+#endif
+
+#include "cactus-plus.hpp"
+
+#ifndef _CACTUS_STACK_NATIVE_H_
+#define _CACTUS_STACK_NATIVE_H_
+
+#if ! defined(__x86_64__) || defined(_WIN32)
+#error "cactus-native.hpp supports only the x86-64 System V ABI"
+#endif
+
+/* Runs C++ code with the native stack pointer inside frames of a
+ * cactus stack. A segment is a frame of a cactus stack whose memory
+ * serves as native stack to the function called on it, and which is
+ * popped when that function returns. Functions that may recurse
+ * deeply call check_stack in their prologue, which moves the rest of
+ * the call to a new segment when the current one runs short.
+ *
+ * A segment lives in a single chunk, so native code wants chunks much
+ * larger than the default, e.g., CACTUS_STACK_BASIC_LG_K=16. A chunk
+ * must at least hold a segment larger than reserve_szb, hence, with
+ * the default reserve, CACTUS_STACK_BASIC_LG_K must be at least 14. Signal
+ * handlers run on whatever stack is current, so a thread that runs on
+ * segments should either install its handlers with sigaltstack or
+ * leave room for them in each segment.
+ */
+
+namespace cactus_stack {
+  namespace native {
+
+    using stack_type = plus::stack_type;
+
+    /*------------------------------*/
+    /* Context switch */
+
+    namespace {
+
+      /* Saves the callee-saved registers on the current stack, stores
+       * the stack pointer in *from_sp, then loads to_sp and restores
+       * the registers that were saved there, such that the ret
+       * returns to the code that saved them.
+       */
+      __attribute__((naked, noinline))
+      void switch_to(void** /* from_sp */, void* /* to_sp */) {
+        asm volatile(
+          "pushq %rbp\n\t"
+          "pushq %rbx\n\t"
+          "pushq %r12\n\t"
+          "pushq %r13\n\t"
+          "pushq %r14\n\t"
+          "pushq %r15\n\t"
+          "movq %rsp, (%rdi)\n\t"
+          "movq %rsi, %rsp\n\t"
+          "popq %r15\n\t"
+          "popq %r14\n\t"
+          "popq %r13\n\t"
+          "popq %r12\n\t"
+          "popq %rbx\n\t"
+          "popq %rbp\n\t"
+          "ret\n\t");
+      }
+
+      // first code to run on a fresh stack: calls r12(r13), which must not return
+      __attribute__((naked, noinline))
+      void trampoline() {
+        asm volatile(
+          "movq %r13, %rdi\n\t"
+          "callq *%r12\n\t"
+          "ud2\n\t");
+      }
+
+      /* Prepares the region [lo, hi) such that switching to the
+       * returned stack pointer calls fn(arg) on that region.
+       */
+      static inline
+      void* make_context(char* lo, char* hi, void (*fn)(void*), void* arg) {
+        uintptr_t top = (uintptr_t)hi & ~(uintptr_t)15;
+        // six registers and the return address, and the stack pointer
+        // left 16-byte aligned by the ret, as the call in trampoline needs
+        void** sp = (void**)(top - 9 * sizeof(void*));
+        assert((char*)sp >= lo);
+        sp[0] = nullptr;            // r15
+        sp[1] = nullptr;            // r14
+        sp[2] = arg;                // r13
+        sp[3] = (void*)fn;          // r12
+        sp[4] = nullptr;            // rbx
+        sp[5] = nullptr;            // rbp
+        sp[6] = (void*)&trampoline; // return address
+        return sp;
+      }
+
+      /* Tell AddressSanitizer, when it is on, about the stack that the
+       * thread is about to switch to, and about the one that it just
+       * switched from.
+       */
+      static inline
+      void start_switch(void** fake_stack_save, const void* bottom, size_t szb) {
+#ifdef CACTUS_STACK_NATIVE_ASAN
+        __sanitizer_start_switch_fiber(fake_stack_save, bottom, szb);
+#else
+        (void)fake_stack_save;
+        (void)bottom;
+        (void)szb;
+#endif
+      }
+
+      static inline
+      void finish_switch(void* fake_stack_save, const void** bottom_old, size_t* szb_old) {
+#ifdef CACTUS_STACK_NATIVE_ASAN
+        __sanitizer_finish_switch_fiber(fake_stack_save, bottom_old, szb_old);
+#else
+        (void)fake_stack_save;
+        (void)bottom_old;
+        (void)szb_old;
+#endif
+      }
+
+      /* Clears the poison that the frames left on a segment that is
+       * about to be popped, since these frames never return.
+       */
+      static inline
+      void unpoison(const void* lo, size_t szb) {
+#ifdef CACTUS_STACK_NATIVE_ASAN
+        __asan_unpoison_memory_region(lo, szb);
+#else
+        (void)lo;
+        (void)szb;
+#endif
+      }
+
+    } // end namespace
+
+    /* Context switch */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Segment */
+
+#ifndef CACTUS_STACK_NATIVE_RESERVE_SZB
+#define CACTUS_STACK_NATIVE_RESERVE_SZB 8192
+#endif
+
+    /* Number of bytes at the low end of each segment that stack_room
+     * does not count, which are left to the code that check_stack
+     * runs to take a new segment, chunk allocation included.
+     */
+    static constexpr
+    size_t reserve_szb = CACTUS_STACK_NATIVE_RESERVE_SZB;
+
+#undef CACTUS_STACK_NATIVE_RESERVE_SZB
+
+    using segment_type = struct segment_struct {
+      // lowest address of the segment that stack_room counts
+      char* lo;
+      // segment on which the segment was entered, if any
+      struct segment_struct* pred;
+    };
+
+    // largest segment that fits in a chunk
+    static constexpr
+    size_t max_segment_szb =
+      (plus::K - sizeof(plus::chunk_header_type) - sizeof(plus::frame_header_type)) & ~(size_t)15;
+
+    static_assert(max_segment_szb > reserve_szb,
+                  "cactus-native.hpp needs chunks larger than reserve_szb: raise CACTUS_STACK_BASIC_LG_K");
+
+    // segment on which the calling thread runs, or nullptr on the stack of the thread
+    inline
+    segment_type*& my_segment() {
+      static thread_local segment_type* s = nullptr;
+      return s;
+    }
+
+    /* Number of bytes left between the stack pointer and the end of
+     * the current segment, or SIZE_MAX on the stack of the thread.
+     */
+    static inline
+    size_t stack_room() {
+      segment_type* s = my_segment();
+      if (s == nullptr) {
+        return SIZE_MAX;
+      }
+      char* sp = (char*)__builtin_frame_address(0);
+      return (sp > s->lo) ? (size_t)(sp - s->lo) : 0;
+    }
+
+    namespace {
+
+      template <class Body>
+      class call_state {
+      public:
+        const Body& body;
+        stack_type s;
+        segment_type segment;
+        std::exception_ptr exception;
+        void* caller_sp;
+        void* fake_stack;
+        const void* caller_bottom;
+        size_t caller_szb;
+
+        call_state(const Body& body, stack_type s)
+          : body(body), s(s), caller_sp(nullptr), fake_stack(nullptr),
+            caller_bottom(nullptr), caller_szb(0) { }
+      };
+
+      template <class Body>
+      void enter_segment(void* p) {
+        auto& st = *(call_state<Body>*)p;
+        finish_switch(nullptr, &st.caller_bottom, &st.caller_szb);
+        try {
+          st.s = st.body(st.s);
+        } catch (...) {
+          st.exception = std::current_exception();
+        }
+        void* sp;
+        // the segment is about to be popped, hence the nullptr
+        start_switch(nullptr, st.caller_bottom, st.caller_szb);
+        switch_to(&sp, st.caller_sp);
+      }
+
+    } // end namespace
+
+    /* Pushes a segment of nb bytes on s and calls body(t) on that
+     * segment, where t is s with the segment on top. The body may
+     * push and pop frames on t, and fork frames off t, but must
+     * return t with the segment back on top. The segment is popped
+     * once body returns, or throws, in which case the exception is
+     * rethrown on the stack of the caller, with s, as passed, being
+     * the current stack again.
+     */
+    template <class Body>
+    stack_type call_on_segment(stack_type s, size_t nb, const Body& body) {
+      assert((nb > reserve_szb) && (nb <= max_segment_szb));
+      s = plus::push_back(s, nb, plus::Parent_link_sync, [] (char*) { }, [] (char*) {
+        return false;
+      });
+      char* lo = plus::frame_data(s.fp);
+      call_state<Body> st(body, s);
+      st.segment.lo = lo + reserve_szb;
+      st.segment.pred = my_segment();
+      void* sp = make_context(lo, lo + nb, &enter_segment<Body>, &st);
+      my_segment() = &st.segment;
+      start_switch(&st.fake_stack, lo, nb);
+      switch_to(&st.caller_sp, sp);
+      finish_switch(st.fake_stack, nullptr, nullptr);
+      my_segment() = st.segment.pred;
+      assert(plus::frame_data(st.s.fp) == lo);
+      unpoison(lo, nb);
+      s = plus::pop_back(st.s, [] (char*, plus::shared_frame_type) { });
+      if (st.exception) {
+        std::rethrow_exception(st.exception);
+      }
+      return s;
+    }
+
+    // stack from which check_stack takes the segments of the calling thread
+    inline
+    stack_type& my_segment_stack() {
+      static thread_local stack_type s = plus::create_stack();
+      return s;
+    }
+
+    /* Meant for the prologue of functions that may recurse deeply:
+     * calls body() right away if at least nb bytes remain on the
+     * current stack, or on a new segment of max_segment_szb bytes
+     * otherwise.
+     */
+    template <class Body>
+    void check_stack(size_t nb, const Body& body) {
+      if (stack_room() >= nb) {
+        body();
+        return;
+      }
+      assert(nb + reserve_szb <= max_segment_szb);
+      stack_type& ss = my_segment_stack();
+      stack_type s = ss;
+      try {
+        ss = call_on_segment(s, max_segment_szb, [&] (stack_type t) {
+          ss = t;
+          body();
+          return ss;
+        });
+      } catch (...) {
+        ss = s;
+        throw;
+      }
+    }
+
+    /* Segment */
+    /*------------------------------*/
+
+  } // end namespace
+} // end namespace
+
+#endif /*! _CACTUS_STACK_NATIVE_H_ */
@@ -10,6 +10,17 @@
 #include <stdlib.h>
 #include <atomic>
 #include <assert.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <iterator>
+#include <type_traits>
+#include <algorithm>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
 
 #ifndef _CACTUS_STACK_PLUS_H_
 #define _CACTUS_STACK_PLUS_H_
@@ -24,6 +35,12 @@ namespace cactus_stack {
       
       struct frame_header_struct;
       
+      struct chunk_struct;
+      
+      struct chunk_cache_struct;
+      
+      struct slab_struct;
+      
       /* Forward declarations */
       /*------------------------------*/
       
@@ -43,17 +60,95 @@ namespace cactus_stack {
       static constexpr
       int K = 1 << lg_K;
 
-      using chunk_header_type = struct {
+#ifndef CACTUS_STACK_CACHE_LINE_SZB
+#define CACTUS_STACK_CACHE_LINE_SZB 64
+#endif
+
+#ifndef CACTUS_STACK_CACHE_ALIGN
+#define CACTUS_STACK_CACHE_ALIGN 0
+#endif
+
+      static constexpr
+      int cache_line_szb = CACTUS_STACK_CACHE_LINE_SZB;
+
+      /* When set, the chunk header fills a whole cache line, and the
+       * frames that may be handed over to another thread, that is,
+       * async frames and loop children, start on a cache line. The
+       * refcount updates and frame writes of a thief then do not
+       * invalidate the lines that hold the frames of the victim.
+       */
+      static constexpr
+      bool cache_align = CACTUS_STACK_CACHE_ALIGN;
+
+#undef CACTUS_STACK_CACHE_LINE_SZB
+#undef CACTUS_STACK_CACHE_ALIGN
+
+      using chunk_header_type = struct alignas(cache_align ? cache_line_szb : alignof(void*)) chunk_header_struct {
         std::atomic<int> refcount;
         struct frame_header_struct* sp;
         struct frame_header_struct* lp;
+        // set once a forked-off stack may begin in the middle of this chunk
+        bool forked;
+        // cache of the thread that allocated the chunk
+        struct chunk_cache_struct* owner;
+        // slab that holds the memory of the chunk, if any
+        struct slab_struct* slab;
+        // next chunk in the free list that holds the chunk, if any
+        struct chunk_struct* next;
+        // epoch at which the chunk was retired, in deferred_reclaim mode
+        uint64_t retire_epoch;
       };
       
-      using chunk_type = struct {
+      using chunk_type = struct chunk_struct {
         chunk_header_type hdr;
         char frames[K - sizeof(chunk_header_type)];
       };
       
+#ifndef CACTUS_STACK_CHUNKS_PER_SLAB
+#define CACTUS_STACK_CHUNKS_PER_SLAB 1
+#endif
+      
+      /* Number of chunks that create_chunk allocates at once, when the
+       * cache of the thread is empty. Allocating chunks one by one
+       * with posix_memalign costs about twice their size in memory,
+       * because of the padding that the alignment takes. Slabs save
+       * the padding, but the memory of a slab is freed only once all
+       * of its chunks are, such that one live chunk can hold on to
+       * the slab.
+       */
+      static constexpr
+      int nb_chunks_per_slab = CACTUS_STACK_CHUNKS_PER_SLAB;
+      
+#undef CACTUS_STACK_CHUNKS_PER_SLAB
+      
+      // contiguous chunks, whose memory is freed once all of them are
+      using slab_type = struct slab_struct {
+        chunk_type* chunks;
+        // number of chunks of the slab not freed yet
+        std::atomic<int> nb_live;
+      };
+      
+      /* Released chunks go back to the cache of the thread that
+       * allocated them, to be reused by the next create_chunk of that
+       * thread, where the memory of the chunk is most likely to be
+       * hot. The owner puts the chunks that it releases itself in its
+       * local list directly. Other threads push to the remote list
+       * without locking, and the owner takes the whole list at once,
+       * which leaves no room for ABA.
+       */
+      using chunk_cache_type = struct chunk_cache_struct {
+        std::atomic<chunk_type*> remote;
+        // chunks ready for reuse, for use by the owner only
+        chunk_type* local;
+        int nb_local;
+        // one for each live chunk of the cache, plus one for the owner
+        std::atomic<int> nb_refs;
+      };
+      
+      // maximum number of chunks kept in the local list of a cache
+      static constexpr
+      int max_nb_local_chunks = 64;
+      
       static inline
       void* aligned_alloc(size_t alignment, size_t size) {
         void* p;
@@ -64,17 +159,166 @@ namespace cactus_stack {
         return p;
       }
       
+      // marks the remote list of a cache whose owner thread has exited
+      static inline
+      chunk_type* closed_chunk_list() {
+        return (chunk_type*)1;
+      }
+      
+      static inline
+      void release_chunk_cache(chunk_cache_type* cache) {
+        if (cache->nb_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete cache;
+        }
+      }
+      
+      static inline
+      void free_chunk(chunk_type* c) {
+        chunk_cache_type* cache = c->hdr.owner;
+        slab_type* sl = c->hdr.slab;
+        if (sl == nullptr) {
+          free(c);
+        } else if (sl->nb_live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          free(sl->chunks);
+          delete sl;
+        }
+        release_chunk_cache(cache);
+      }
+      
+      static inline
+      void free_chunk_list(chunk_type* c) {
+        while (c != nullptr) {
+          chunk_type* next = c->hdr.next;
+          free_chunk(c);
+          c = next;
+        }
+      }
+      
+      class chunk_cache_holder {
+      public:
+        
+        chunk_cache_type* cache;
+        
+        chunk_cache_holder() {
+          cache = new chunk_cache_type;
+          cache->remote.store(nullptr);
+          cache->local = nullptr;
+          cache->nb_local = 0;
+          cache->nb_refs.store(1);
+        }
+        
+        ~chunk_cache_holder() {
+          chunk_type* c = cache->remote.exchange(closed_chunk_list(), std::memory_order_acquire);
+          free_chunk_list(c);
+          free_chunk_list(cache->local);
+          release_chunk_cache(cache);
+        }
+        
+      };
+      
+      static inline
+      chunk_cache_type* my_chunk_cache() {
+        static thread_local chunk_cache_holder h;
+        return h.cache;
+      }
+      
+      // to be called by the owner of the cache only
+      static inline
+      void push_local_chunk(chunk_cache_type* cache, chunk_type* c) {
+        if (cache->nb_local < max_nb_local_chunks) {
+          c->hdr.next = cache->local;
+          cache->local = c;
+          cache->nb_local++;
+        } else {
+          free_chunk(c);
+        }
+      }
+      
+      static inline
+      chunk_type* take_local_chunk(chunk_cache_type* cache) {
+        if (cache->local == nullptr) {
+          chunk_type* c = cache->remote.exchange(nullptr, std::memory_order_acquire);
+          while (c != nullptr) {
+            chunk_type* next = c->hdr.next;
+            push_local_chunk(cache, c);
+            c = next;
+          }
+        }
+        chunk_type* c = cache->local;
+        if (c != nullptr) {
+          cache->local = c->hdr.next;
+          cache->nb_local--;
+        }
+        return c;
+      }
+      
+      /* Allocates a slab for the cache of the calling thread, puts
+       * all of its chunks but the first in the local list of the
+       * cache, and returns the first.
+       */
+      static inline
+      chunk_type* create_slab(chunk_cache_type* cache) {
+        chunk_type* cs = (chunk_type*)aligned_alloc(K, nb_chunks_per_slab * K);
+        slab_type* sl = new slab_type;
+        sl->chunks = cs;
+        sl->nb_live.store(nb_chunks_per_slab);
+        cache->nb_refs.fetch_add(nb_chunks_per_slab, std::memory_order_relaxed);
+        for (int i = nb_chunks_per_slab - 1; i >= 0; i--) {
+          chunk_type* c = new (&cs[i]) chunk_type;
+          c->hdr.owner = cache;
+          c->hdr.slab = sl;
+          if (i > 0) {
+            push_local_chunk(cache, c);
+          }
+        }
+        return &cs[0];
+      }
+      
       static inline
       chunk_type* create_chunk(struct frame_header_struct* sp,
                                struct frame_header_struct* lp) {
-        chunk_type* c = (chunk_type*)aligned_alloc(K, K);
+        chunk_cache_type* cache = my_chunk_cache();
+        chunk_type* c = take_local_chunk(cache);
+        slab_type* sl = nullptr;
+        if (c != nullptr) {
+          sl = c->hdr.slab;
+        } else if (nb_chunks_per_slab > 1) {
+          c = create_slab(cache);
+          sl = c->hdr.slab;
+        } else {
+          c = (chunk_type*)aligned_alloc(K, K);
+          cache->nb_refs.fetch_add(1, std::memory_order_relaxed);
+        }
         new (c) chunk_type;
+        c->hdr.slab = sl;
         c->hdr.refcount.store(1);
         c->hdr.sp = sp;
         c->hdr.lp = lp;
+        c->hdr.forked = false;
+        c->hdr.owner = cache;
+        c->hdr.next = nullptr;
         return c;
       }
       
+      static inline
+      void release_chunk(chunk_type* c) {
+        chunk_cache_type* cache = c->hdr.owner;
+        if (cache == my_chunk_cache()) {
+          push_local_chunk(cache, c);
+          return;
+        }
+        chunk_type* head = cache->remote.load(std::memory_order_relaxed);
+        do {
+          if (head == closed_chunk_list()) {
+            free_chunk(c);
+            return;
+          }
+          c->hdr.next = head;
+        } while (! cache->remote.compare_exchange_weak(head, c,
+                                                       std::memory_order_release,
+                                                       std::memory_order_relaxed));
+      }
+      
       template <class T>
       chunk_type* chunk_of(T* p) {
         uintptr_t v = (uintptr_t)(((char*)p) - 1);
@@ -92,14 +336,269 @@ namespace cactus_stack {
         c->hdr.refcount++;
       }
       
+#ifndef CACTUS_STACK_DEFERRED_RECLAIM
+#define CACTUS_STACK_DEFERRED_RECLAIM 0
+#endif
+
+      /* When set, a chunk whose refcount drops to zero is retired
+       * rather than released, and it is released only once every
+       * thread that was in a read section at the time has left it.
+       * A thread may then walk the frames of a stack owned by
+       * another thread, e.g., with iterator or mark_iterator, from
+       * inside a read_guard, without stopping that thread: the
+       * chunks that it reaches stay allocated until the end of the
+       * read section, although their frames may change under it.
+       */
+      static constexpr
+      bool deferred_reclaim = CACTUS_STACK_DEFERRED_RECLAIM;
+
+#undef CACTUS_STACK_DEFERRED_RECLAIM
+
+      /* Number of chunks that a thread retires between two
+       * reclamations, at least. A reader that stays in its read
+       * section keeps every chunk retired since it entered it, so,
+       * to keep the cost of the scans constant per retire, the next
+       * reclamation waits until the retire list has doubled whenever
+       * a reclamation leaves more than reclaim_period chunks.
+       */
+      static constexpr
+      int reclaim_period = 64;
+
+      using epoch_record_type = struct epoch_record_struct {
+        // epoch announced by the reader, or zero outside of read sections
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> in_use;
+        struct epoch_record_struct* next;
+      };
+
+      class epoch_domain {
+      public:
+
+        std::atomic<uint64_t> epoch;
+        // one record for each thread that ever took part, never freed
+        std::atomic<epoch_record_type*> records;
+        // chunks retired by threads that have exited
+        std::atomic<chunk_type*> orphans;
+
+        epoch_domain() {
+          epoch.store(1);
+          records.store(nullptr);
+          orphans.store(nullptr);
+        }
+
+      };
+
+      // inline rather than static, to share the domain between translation units
+      inline
+      epoch_domain& the_epoch_domain() {
+        static epoch_domain d;
+        return d;
+      }
+
+      static inline
+      void push_chunk_list(std::atomic<chunk_type*>& list, chunk_type* c) {
+        if (c == nullptr) {
+          return;
+        }
+        chunk_type* last = c;
+        while (last->hdr.next != nullptr) {
+          last = last->hdr.next;
+        }
+        chunk_type* head = list.load(std::memory_order_relaxed);
+        do {
+          last->hdr.next = head;
+        } while (! list.compare_exchange_weak(head, c,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+      }
+
+      class epoch_participant {
+      public:
+
+        epoch_record_type* rec;
+        // nesting depth of read sections
+        int depth = 0;
+        chunk_type* retired = nullptr;
+        int nb_retired = 0;
+        // length of the retire list that triggers the next reclamation
+        int reclaim_at = reclaim_period;
+
+        epoch_participant() {
+          epoch_domain& d = the_epoch_domain();
+          for (rec = d.records.load(std::memory_order_acquire); rec != nullptr; rec = rec->next) {
+            bool b = false;
+            if (rec->in_use.compare_exchange_strong(b, true)) {
+              return;
+            }
+          }
+          rec = new epoch_record_type;
+          rec->epoch.store(0);
+          rec->in_use.store(true);
+          rec->next = d.records.load(std::memory_order_relaxed);
+          while (! d.records.compare_exchange_weak(rec->next, rec,
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed));
+        }
+
+        ~epoch_participant() {
+          // the chunks are left to the next reclamation of another thread
+          push_chunk_list(the_epoch_domain().orphans, retired);
+          rec->epoch.store(0);
+          rec->in_use.store(false);
+        }
+
+      };
+
+      static inline
+      epoch_participant& my_epoch_participant() {
+        static thread_local epoch_participant p;
+        return p;
+      }
+
+      // returns the current epoch, after advancing it if no reader lags behind
+      static inline
+      uint64_t try_advance_epoch() {
+        epoch_domain& d = the_epoch_domain();
+        uint64_t e = d.epoch.load();
+        for (auto r = d.records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+          uint64_t re = r->epoch.load();
+          if ((re != 0) && (re != e)) {
+            return e;
+          }
+        }
+        if (d.epoch.compare_exchange_strong(e, e + 1)) {
+          e++;
+        }
+        return e;
+      }
+
+      /* Releases the chunks retired by the calling thread, and those
+       * left by exited threads, that no reader can still reach.
+       */
+      static inline
+      void reclaim_chunks() {
+        epoch_participant& p = my_epoch_participant();
+        uint64_t e = try_advance_epoch();
+        chunk_type* c = the_epoch_domain().orphans.exchange(nullptr, std::memory_order_acquire);
+        while (c != nullptr) {
+          chunk_type* next = c->hdr.next;
+          c->hdr.next = p.retired;
+          p.retired = c;
+          p.nb_retired++;
+          c = next;
+        }
+        chunk_type* retired = nullptr;
+        p.nb_retired = 0;
+        for (c = p.retired; c != nullptr; ) {
+          chunk_type* next = c->hdr.next;
+          // a reader that entered at epoch r blocks the epoch at r + 1
+          if (c->hdr.retire_epoch + 2 <= e) {
+            c->hdr.next = nullptr;
+            release_chunk(c);
+          } else {
+            c->hdr.next = retired;
+            retired = c;
+            p.nb_retired++;
+          }
+          c = next;
+        }
+        p.retired = retired;
+        p.reclaim_at = std::max(reclaim_period, 2 * p.nb_retired);
+      }
+
+      static inline
+      void retire_chunk(chunk_type* c) {
+        epoch_participant& p = my_epoch_participant();
+        c->hdr.retire_epoch = the_epoch_domain().epoch.load();
+        c->hdr.next = p.retired;
+        p.retired = c;
+        if (++p.nb_retired >= p.reclaim_at) {
+          reclaim_chunks();
+        }
+      }
+
+      /* Delimits a read section, in deferred_reclaim mode; does
+       * nothing otherwise. Read sections may be nested.
+       */
+      class read_guard {
+      public:
+
+        read_guard() {
+          if (! deferred_reclaim) {
+            return;
+          }
+          epoch_participant& p = my_epoch_participant();
+          if (p.depth++ == 0) {
+            p.rec->epoch.store(the_epoch_domain().epoch.load());
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+          }
+        }
+
+        ~read_guard() {
+          if (! deferred_reclaim) {
+            return;
+          }
+          epoch_participant& p = my_epoch_participant();
+          if (--p.depth == 0) {
+            p.rec->epoch.store(0, std::memory_order_release);
+          }
+        }
+
+        read_guard(const read_guard&) = delete;
+
+        read_guard& operator=(const read_guard&) = delete;
+
+      };
+      
       static inline
       void decr_refcount(chunk_type* c) {
         assert(c->hdr.refcount.load() >= 1);
         if (--c->hdr.refcount == 0) {
-          free(c);
+          if (deferred_reclaim) {
+            retire_chunk(c);
+          } else {
+            release_chunk(c);
+          }
         }
       }
       
+#ifndef CACTUS_STACK_PERSISTENT
+#define CACTUS_STACK_PERSISTENT 0
+#endif
+
+      /* When set, stacks are persistent: snapshot takes a copy of a
+       * stack in constant time, after which the copy and the stack
+       * share their frames, and pushes copy on write, in that a frame
+       * is placed in the chunk of the top frame only if the stack is
+       * the sole owner of that chunk, and in a fresh chunk otherwise.
+       * To that end, each chunk holds a reference on the chunk of the
+       * predecessor of its bottom frame, and a stack one on the chunk
+       * of its top frame only. Stacks may then not be forked, and
+       * their frames must not change once shared. See snapshot.
+       */
+      static constexpr
+      bool persistent = CACTUS_STACK_PERSISTENT;
+
+#undef CACTUS_STACK_PERSISTENT
+
+      static inline
+      bool is_shared(chunk_type* c) {
+        return persistent && (c->hdr.refcount.load(std::memory_order_relaxed) > 1);
+      }
+
+      /* Drops the reference of a stack on the chunk c, which it leaves
+       * for the chunk of fp, the predecessor of the bottom frame of c.
+       * In persistent mode, the stack takes over the reference of c
+       * on the chunk of fp, and takes one of its own if c stays.
+       */
+      template <class T>
+      void leave_chunk(chunk_type* c, T* fp) {
+        if (is_shared(c) && (fp != nullptr)) {
+          incr_refcount(chunk_of(fp));
+        }
+        decr_refcount(c);
+      }
+      
       /* Stack chunk */
       /*------------------------------*/
       
@@ -126,11 +625,91 @@ namespace cactus_stack {
         struct frame_header_struct* succ;
       };
       
-      using frame_header_type = struct frame_header_struct {
+#ifndef CACTUS_STACK_JOIN_COUNTER
+#define CACTUS_STACK_JOIN_COUNTER 0
+#endif
+
+      /* When set, every frame header carries a join counter, which
+       * counts the children of the frame that fork_mark or
+       * split_mark have forked off and that have not yet been
+       * popped, and the bottom frame of a forked-off stack points
+       * to the header of its parent. See try_join.
+       */
+      static constexpr
+      bool join_counter = CACTUS_STACK_JOIN_COUNTER;
+
+#undef CACTUS_STACK_JOIN_COUNTER
+
+      // empty, and thus of size zero as a base, when join counters are off
+      template <bool Enabled>
+      struct frame_header_join_struct { };
+
+      template <>
+      struct frame_header_join_struct<true> {
+        std::atomic<int> join;
+        struct frame_header_struct* join_fp;
+      };
+      
+      using frame_header_type = struct frame_header_struct : frame_header_join_struct<join_counter> {
         struct frame_header_struct* pred;
         frame_header_ext_type ext;
       };
       
+      using join_counter_tag = std::integral_constant<bool, join_counter>;
+      
+      /* The join operations below do nothing when join counters are
+       * off; they are templates so that the bodies that access the
+       * counters are not even instantiated then.
+       */
+      
+      template <class Header>
+      void join_init(Header*, std::false_type) { }
+      
+      template <class Header>
+      void join_init(Header* fp, std::true_type) {
+        fp->join.store(0, std::memory_order_relaxed);
+        fp->join_fp = nullptr;
+      }
+      
+      // counts one more forked-off child of parent, child being its frame
+      template <class Header>
+      void join_fork(Header*, Header*, std::false_type) { }
+      
+      template <class Header>
+      void join_fork(Header* parent, Header* child, std::true_type) {
+        parent->join.fetch_add(1, std::memory_order_relaxed);
+        child->join_fp = parent;
+      }
+      
+      // called as the frame fp is popped
+      template <class Header>
+      void join_leave(Header*, std::false_type) { }
+      
+      template <class Header>
+      void join_leave(Header* fp, std::true_type) {
+        if (fp->join_fp != nullptr) {
+          fp->join_fp->join.fetch_sub(1, std::memory_order_release);
+        }
+      }
+      
+      template <class Header>
+      bool try_join(Header*, std::false_type) {
+        return true;
+      }
+      
+      template <class Header>
+      bool try_join(Header* fp, std::true_type) {
+        return fp->join.load(std::memory_order_acquire) == 0;
+      }
+      
+      template <class Header, class Relocate>
+      void join_relocate(Header*, const Relocate&, std::false_type) { }
+      
+      template <class Header, class Relocate>
+      void join_relocate(Header* fp, const Relocate& reloc, std::true_type) {
+        fp->join_fp = reloc(fp->join_fp);
+      }
+      
       template <class T=char>
       T* frame_data(frame_header_type* p) {
         char* r = (char*)p;
@@ -143,6 +722,19 @@ namespace cactus_stack {
         return (T*)r;
       }
       
+      // inverse of frame_data
+      static inline
+      frame_header_type* frame_header_of(char* _ar) {
+        return (frame_header_type*)(_ar - sizeof(frame_header_type));
+      }
+      
+      static inline
+      frame_header_type* align_to_cache_line(frame_header_type* p) {
+        uintptr_t v = (uintptr_t)p;
+        v = (v + (cache_line_szb - 1)) & ~(uintptr_t)(cache_line_szb - 1);
+        return (frame_header_type*)v;
+      }
+      
       /* Frame */
       /*------------------------------*/
       
@@ -284,12 +876,25 @@ namespace cactus_stack {
     /*------------------------------*/
     /* Stack */
 
+    using parallelism_type = struct parallelism_struct {
+      // number of frames in the mark list
+      int nb_marks;
+      // sum of the iterations that remain in the loops of the mark list
+      long nb_iters;
+    };
+
     class stack_type {
     public:
 
       frame_header_type* fp, * sp, * lp;
       frame_header_type* mhd, * mtl;
 
+      /* Maintained by the owner of the stack as it goes, with plain
+       * stores: nb_marks by the operations on the mark list, and
+       * nb_iters by the owner itself, through add_nb_iters.
+       */
+      parallelism_type par;
+
       iterator begin() {
         return iterator(fp);
       }
@@ -343,6 +948,7 @@ namespace cactus_stack {
         if (t.mhd == nullptr) {
           t.mhd = t.mtl;
         }
+        t.par.nb_marks++;
         return t;
       }
       
@@ -370,6 +976,7 @@ namespace cactus_stack {
           succ->ext.pred = nullptr;
         }
         t.mtl = pred;
+        t.par.nb_marks--;
         return t;
       }
       
@@ -397,6 +1004,7 @@ namespace cactus_stack {
           pred->ext.succ = nullptr;
         }
         t.mhd = succ;
+        t.par.nb_marks--;
         return t;
       }
       
@@ -430,6 +1038,7 @@ namespace cactus_stack {
             mhd->ext.succ = nullptr;
           }
           mhd = succ;
+          t.par.nb_marks--;
         }
         if (mhd == nullptr) {
           t.mtl = mhd;
@@ -474,12 +1083,117 @@ namespace cactus_stack {
       return t;
     }
     
+    /* Updates in place the mark list of s after the frame fp of s
+     * has become splittable, when b is true, or has stopped being
+     * splittable. Unlike update_mark_stack, does not rescan the mark
+     * list: fp stays in, or is appended to, the mark list iff b is
+     * true or fp is a mark frame for another reason, e.g., an async
+     * call. When fp becomes splittable below the top, the frame just
+     * above it becomes its loop child, as if pushed afterwards by
+     * push_back. When fp stops being splittable, that frame stops
+     * being its loop child, and stays in the mark list only if it is
+     * a mark frame by itself: this is the only frame on which
+     * is_splittable_fn is called. Takes constant time when fp is the
+     * top frame of s, and otherwise time linear in the number of
+     * frames above fp.
+     */
+    template <class Is_splittable_fn>
+    stack_type set_splittable(stack_type s,
+                              frame_header_type* fp,
+                              bool b,
+                              const Is_splittable_fn& is_splittable_fn) {
+      stack_type t = s;
+      auto in_mark_list = [&] (frame_header_type* f) {
+        return (f == t.mhd) || (f->ext.pred != nullptr);
+      };
+      auto insert = [&] (frame_header_type* f) {
+        // succ is the mark that is nearest above f, if any
+        frame_header_type* succ = nullptr;
+        for (frame_header_type* g = t.fp; g != f; g = g->pred) {
+          if (in_mark_list(g)) {
+            succ = g;
+          }
+        }
+        frame_header_type* pred = (succ == nullptr) ? t.mtl : succ->ext.pred;
+        f->ext.pred = pred;
+        f->ext.succ = succ;
+        if (pred == nullptr) {
+          t.mhd = f;
+        } else {
+          pred->ext.succ = f;
+        }
+        if (succ == nullptr) {
+          t.mtl = f;
+        } else {
+          succ->ext.pred = f;
+        }
+        t.par.nb_marks++;
+      };
+      auto remove = [&] (frame_header_type* f) {
+        frame_header_type* pred = f->ext.pred;
+        frame_header_type* succ = f->ext.succ;
+        if (pred == nullptr) {
+          t.mhd = succ;
+        } else {
+          pred->ext.succ = succ;
+        }
+        if (succ == nullptr) {
+          t.mtl = pred;
+        } else {
+          succ->ext.pred = pred;
+        }
+        f->ext.pred = nullptr;
+        f->ext.succ = nullptr;
+        t.par.nb_marks--;
+      };
+      if (fp != t.fp) {
+        frame_header_type* c = t.fp;
+        while (c->pred != fp) {
+          c = c->pred;
+        }
+        if (b) {
+          c->ext.llt = Loop_link_child;
+          if (! in_mark_list(c)) {
+            insert(c);
+          }
+        } else if (c->ext.llt == Loop_link_child) {
+          c->ext.llt = Loop_link_none;
+          if (in_mark_list(c) && ! is_mark_frame(c, is_splittable_fn)) {
+            remove(c);
+          }
+        }
+      }
+      bool marked = b || (fp->ext.clt == Call_link_async) || (fp->ext.llt == Loop_link_child);
+      if (in_mark_list(fp) == marked) {
+        return t;
+      }
+      if (marked) {
+        insert(fp);
+      } else {
+        remove(fp);
+      }
+      return t;
+    }
+    
     stack_type create_stack() {
       return {
         .fp = nullptr, .sp = nullptr, .lp = nullptr,
-        .mhd = nullptr, .mtl = nullptr
+        .mhd = nullptr, .mtl = nullptr,
+        .par = { 0, 0 }
       };
     }
+
+    /* Adds d to the number of iterations that the owner of s
+     * reports for the loops in the mark list of s. Forking leaves
+     * the count with the stack that keeps the bottom of s, so the
+     * owner moves the count of the frames that it forks off, if it
+     * keeps one for them.
+     */
+    stack_type add_nb_iters(stack_type s, long d) {
+      stack_type t = s;
+      t.par.nb_iters += d;
+      return t;
+    }
     
     template <class Read_fn>
     void peek_back(stack_type s, const Read_fn& read_fn) {
@@ -503,8 +1217,38 @@ namespace cactus_stack {
       Parent_link_async, Parent_link_sync
     };
     
-    template <int frame_szb, class Initialize_fn, class Is_splittable_fn>
+    namespace {
+
+      /* Fills in the header of the frame t.fp, which has just been
+       * placed on top of the frame pred, and appends the frame to
+       * the mark list of t if it is a mark frame.
+       */
+      template <class Is_splittable_fn>
+      stack_type link_back(stack_type t,
+                           frame_header_type* pred,
+                           parent_link_type ty,
+                           const Is_splittable_fn& is_splittable_fn) {
+        frame_header_ext_type ext;
+        ext.pred = nullptr;
+        ext.sft = Shared_frame_direct;
+        ext.clt = ((ty == Parent_link_async) ? Call_link_async : Call_link_sync);
+        ext.llt = (((pred != nullptr) && is_splittable_fn(frame_data(pred))) ? Loop_link_child : Loop_link_none);
+        ext.succ = nullptr;
+        t.fp->pred = pred;
+        t.fp->ext = ext;
+        join_init(t.fp, join_counter_tag());
+        t = try_push_mark_back(t, t.fp, is_splittable_fn);
+        return t;
+      }
+
+    } // end namespace
+    
+    /* Same as push_back<frame_szb>, for frames whose size is known
+     * only at run time.
+     */
+    template <class Initialize_fn, class Is_splittable_fn>
     stack_type push_back(stack_type s,
+                         size_t frame_szb,
                          parent_link_type ty,
                          const Initialize_fn& initialize_fn,
                          const Is_splittable_fn& is_splittable_fn) {
@@ -512,31 +1256,35 @@ namespace cactus_stack {
       auto b = sizeof(frame_header_type) + frame_szb;
       assert(b + sizeof(chunk_header_type) <= K);
       t.fp = s.sp;
+      if (cache_align &&
+          ((ty == Parent_link_async) ||
+           ((s.fp != nullptr) && is_splittable_fn(frame_data(s.fp))))) {
+        t.fp = align_to_cache_line(t.fp);
+      }
       t.sp = (frame_header_type*)((char*)t.fp + b);
-      if (t.sp >= t.lp) {
+      if ((t.sp >= t.lp) || ((s.fp != nullptr) && is_shared(chunk_of(s.fp)))) {
         chunk_type* c = create_chunk(s.sp, s.lp);
         t.fp = (frame_header_type*)chunk_data(c);
         t.sp = (frame_header_type*)((char*)t.fp + b);
         t.lp = (frame_header_type*)((char*)c + K);
       }
       initialize_fn(frame_data(t.fp));
-      frame_header_type* pred = s.fp;
-      frame_header_ext_type ext;
-      ext.pred = nullptr;
-      ext.sft = Shared_frame_direct;
-      ext.clt = ((ty == Parent_link_async) ? Call_link_async : Call_link_sync);
-      ext.llt = (((pred != nullptr) && is_splittable_fn(frame_data(pred))) ? Loop_link_child : Loop_link_none);
-      ext.succ = nullptr;
-      t.fp->pred = pred;
-      t.fp->ext = ext;
-      t = try_push_mark_back(t, t.fp, is_splittable_fn);
-      return t;
+      return link_back(t, s.fp, ty, is_splittable_fn);
+    }
+    
+    template <int frame_szb, class Initialize_fn, class Is_splittable_fn>
+    stack_type push_back(stack_type s,
+                         parent_link_type ty,
+                         const Initialize_fn& initialize_fn,
+                         const Is_splittable_fn& is_splittable_fn) {
+      return push_back(s, (size_t)frame_szb, ty, initialize_fn, is_splittable_fn);
     }
     
     template <class Destruct_fn>
     stack_type pop_back(stack_type s, const Destruct_fn& destruct_fn) {
       stack_type t = s;
       destruct_fn(frame_data(s.fp), s.fp->ext.sft);
+      join_leave(s.fp, join_counter_tag());
       if (t.mtl == t.fp) {
         t = pop_mark_back(t);
       }
@@ -548,13 +1296,189 @@ namespace cactus_stack {
       } else {
         t.sp = cfp->hdr.sp;
         t.lp = cfp->hdr.lp;
-        decr_refcount(cfp);
+        leave_chunk(cfp, t.fp);
+      }
+      if (t.fp == nullptr) {
+        // the region saved in the bottom chunk of a forked-off stack
+        // belongs to the stack that it was forked from
+        t.sp = nullptr;
+        t.lp = nullptr;
       }
       return t;
     }
-    
+
+    /* Replaces the top frame of s by a new frame, as pop_back
+     * followed by push_back would, but reuses the memory of the
+     * top frame when the new frame fits in the space between the
+     * top frame and the limit of the current allocation region.
+     * With cache_align, the new frame is moved up to the next cache
+     * line when push_back would align it, e.g., when it is async.
+     */
+    template <int frame_szb, class Destruct_fn, class Initialize_fn, class Is_splittable_fn>
+    stack_type replace_back(stack_type s,
+                            parent_link_type ty,
+                            const Destruct_fn& destruct_fn,
+                            const Initialize_fn& initialize_fn,
+                            const Is_splittable_fn& is_splittable_fn) {
+      assert(! empty(s));
+      auto b = sizeof(frame_header_type) + frame_szb;
+      frame_header_type* pred = s.fp->pred;
+      frame_header_type* fp = s.fp;
+      if (cache_align &&
+          ((ty == Parent_link_async) ||
+           ((pred != nullptr) && is_splittable_fn(frame_data(pred))))) {
+        fp = align_to_cache_line(fp);
+      }
+      auto sp = (frame_header_type*)((char*)fp + b);
+      if ((s.lp == nullptr) || (sp >= s.lp) || is_shared(chunk_of(s.fp))) {
+        stack_type t = pop_back(s, destruct_fn);
+        return push_back<frame_szb>(t, ty, initialize_fn, is_splittable_fn);
+      }
+      stack_type t = s;
+      destruct_fn(frame_data(s.fp), s.fp->ext.sft);
+      join_leave(s.fp, join_counter_tag());
+      if (t.mtl == t.fp) {
+        t = pop_mark_back(t);
+      }
+      t.fp = fp;
+      t.sp = sp;
+      initialize_fn(frame_data(t.fp));
+      return link_back(t, pred, ty, is_splittable_fn);
+    }
+
+    /* Extends the top frame of s by nb bytes, aligned on align,
+     * taken from the allocation region that follows the frame.
+     * Returns the updated stack along with the address of the
+     * new space, or nullptr if the region is too small, in which
+     * case s is returned unchanged. The space belongs to the top
+     * frame: it is released when the frame is popped and it stays
+     * with the frame when the stack is forked.
+     */
+    std::pair<stack_type, char*> extend_back(stack_type s,
+                                             size_t nb,
+                                             size_t align = alignof(std::max_align_t)) {
+      assert(! empty(s));
+      assert((align & (align - 1)) == 0);
+      stack_type t = s;
+      if ((s.sp == nullptr) || is_shared(chunk_of(s.fp))) {
+        return std::make_pair(t, (char*)nullptr);
+      }
+      uintptr_t p = ((uintptr_t)s.sp + (align - 1)) & ~(uintptr_t)(align - 1);
+      // keeps the next frame header properly aligned
+      uintptr_t a = alignof(frame_header_type);
+      uintptr_t sp = (p + nb + (a - 1)) & ~(a - 1);
+      if (sp > (uintptr_t)s.lp) {
+        return std::make_pair(t, (char*)nullptr);
+      }
+      t.sp = (frame_header_type*)sp;
+      return std::make_pair(t, (char*)p);
+    }
+
+    /* Ends the allocation region of s at the top of s, so that the
+     * next push_back starts a new chunk instead of reusing the memory
+     * above the top frame, e.g., that of a frame just popped whose
+     * chunk is kept alive by a reference taken with incr_refcount.
+     */
+    stack_type end_region(stack_type s) {
+      stack_type t = s;
+      t.lp = t.sp;
+      return t;
+    }
+
+    namespace {
+
+      /* Pops all the frames of s lying above target, which is either
+       * nullptr or a frame of s, calling destruct_fn on each popped
+       * frame only if visit_frames is set. The result is the stack
+       * that the corresponding sequence of pop_back calls would
+       * produce, but each chunk is released by a single refcount
+       * decrement and the mark list is trimmed chunk by chunk.
+       * A frame placed at the start of a chunk that was never
+       * forked is necessarily the bottom-most frame of s in that
+       * chunk, which lets us skip over the chunk in one step when
+       * the frames need not be visited.
+       */
+      template <bool visit_frames, class Destruct_fn>
+      stack_type pop_chunks_until(stack_type s,
+                                  frame_header_type* target,
+                                  const Destruct_fn& destruct_fn) {
+        stack_type t = s;
+        chunk_type* ctarget = chunk_of(target);
+        frame_header_type* fp = s.fp;
+        while (fp != target) {
+          chunk_type* c = chunk_of(fp);
+          if (c == ctarget) {
+            while (fp != target) {
+              frame_header_type* pred = fp->pred;
+              if (visit_frames) {
+                destruct_fn(frame_data(fp), fp->ext.sft);
+              }
+              join_leave(fp, join_counter_tag());
+              t.sp = fp;
+              fp = pred;
+            }
+            break;
+          }
+          if (visit_frames || c->hdr.forked) {
+            while (chunk_of(fp) == c) {
+              frame_header_type* pred = fp->pred;
+              if (visit_frames) {
+                destruct_fn(frame_data(fp), fp->ext.sft);
+              }
+              join_leave(fp, join_counter_tag());
+              fp = pred;
+            }
+          } else {
+            frame_header_type* bottom = (frame_header_type*)chunk_data(c);
+            join_leave(bottom, join_counter_tag());
+            fp = bottom->pred;
+          }
+          while ((t.mtl != nullptr) && (chunk_of(t.mtl) == c)) {
+            t = pop_mark_back(t);
+          }
+          t.sp = c->hdr.sp;
+          t.lp = c->hdr.lp;
+          leave_chunk(c, fp);
+        }
+        // frames of the same chunk are laid out in stack order
+        while ((t.mtl != nullptr) && (chunk_of(t.mtl) == ctarget) && (t.mtl > target)) {
+          t = pop_mark_back(t);
+        }
+        t.fp = target;
+        if (target == nullptr) {
+          t.sp = nullptr;
+          t.lp = nullptr;
+        }
+        return t;
+      }
+
+    } // end namespace
+
+    template <class Destruct_fn>
+    stack_type pop_until(stack_type s,
+                         frame_header_type* target_fp,
+                         const Destruct_fn& destruct_fn) {
+      return pop_chunks_until<true>(s, target_fp, destruct_fn);
+    }
+
+    // for stacks whose frames are all trivially destructible
+    stack_type pop_until(stack_type s, frame_header_type* target_fp) {
+      return pop_chunks_until<false>(s, target_fp, [] (char*, shared_frame_type) { });
+    }
+
+    template <class Destruct_fn>
+    void destroy_stack(stack_type s, const Destruct_fn& destruct_fn) {
+      pop_until(s, nullptr, destruct_fn);
+    }
+
+    // for stacks whose frames are all trivially destructible
+    void destroy_stack(stack_type s) {
+      pop_until(s, nullptr);
+    }
+
     template <class Is_splittable_fn>
     std::pair<stack_type, stack_type> fork_mark(stack_type s, const Is_splittable_fn& is_splittable_fn) {
+      assert(! persistent);
       stack_type s1 = s;
       stack_type s2 = create_stack();
       if (empty_mark(s)) {
@@ -576,26 +1500,162 @@ namespace cactus_stack {
       chunk_type* cf1 = chunk_of(pf1);
       if (cf1 == chunk_of(pf2)) {
         incr_refcount(cf1);
-      }
-      if (chunk_of(s.sp) == cf1) {
+        cf1->hdr.forked = true;
         s1.sp = pf2;
       } else {
         s1.sp = nullptr;
       }
       s1.lp = s1.sp;
       s1.mtl = s1.mhd;
+      s1.par.nb_marks = (s1.mhd == nullptr) ? 0 : 1;
       s2 = s;
       s2.mhd = pf2;
+      s2.par.nb_marks = s.par.nb_marks - s1.par.nb_marks;
+      s2.par.nb_iters = 0;
       pf1->ext.succ = nullptr;
       pf2->pred = nullptr;
       pf2->ext.pred = nullptr;
+      join_fork(pf1, pf2, join_counter_tag());
+      if (s1.mhd != nullptr) {
+        s1.mhd->ext.succ = nullptr;
+      }
       s1 = try_pop_mark_back(s1, is_splittable_fn);
       s2 = try_pop_mark_front(s2, is_splittable_fn);
       return std::make_pair(s1, s2);
     }
     
+    /* Forks off, in one pass over the mark list of s, the frames of
+     * s above each of its k oldest async marks, oldest first, as if
+     * by repeated calls to fork_mark on the second stack returned by
+     * the previous one. Calls forked_fn(t) on each stack t that is
+     * forked off, in order, the last one holding the top of s, and
+     * returns the stack that remains, which ends at the parent of
+     * the oldest mark. The pass stops early at the first mark that
+     * is not async, e.g., a splittable loop frame.
+     */
+    template <class Forked_fn, class Is_splittable_fn>
+    stack_type fork_marks(stack_type s,
+                          int k,
+                          const Forked_fn& forked_fn,
+                          const Is_splittable_fn& is_splittable_fn) {
+      assert(! persistent);
+      if (k <= 0) {
+        return s;
+      }
+      auto r = fork_mark(s, is_splittable_fn);
+      if (empty(r.second)) {
+        return s;
+      }
+      stack_type t = r.second;
+      for (int i = 1; i < k; i++) {
+        // the bottom frame of t is its oldest mark, if it is still marked
+        frame_header_type* pf = t.mhd;
+        if ((pf != nullptr) && (pf->pred == nullptr)) {
+          pf = pf->ext.succ;
+        }
+        if ((pf == nullptr) || (pf->ext.clt != Call_link_async)) {
+          break;
+        }
+        auto r2 = fork_mark(t, is_splittable_fn);
+        forked_fn(r2.first);
+        t = r2.second;
+      }
+      forked_fn(t);
+      return r.first;
+    }
+    
+    /* Same as fork_mark, except that when the frames of s2 that
+     * share a chunk with the top frame of s1 take up no more than
+     * max_szb bytes, they are moved to a fresh chunk owned by s2.
+     * The two stacks then have no chunk in common, and s1 gets
+     * back the space that the moved frames occupied. Frames are
+     * moved by memcpy: relocate_fn(_ar, delta) is called on each
+     * moved frame, at its new address, to let it adjust pointers
+     * that it holds into moved frames. No other frame may hold a
+     * pointer into a moved frame.
+     */
+    template <class Relocate_fn, class Is_splittable_fn>
+    std::pair<stack_type, stack_type> fork_mark_copy(stack_type s,
+                                                     size_t max_szb,
+                                                     const Relocate_fn& relocate_fn,
+                                                     const Is_splittable_fn& is_splittable_fn) {
+      assert(! persistent);
+      auto r = fork_mark(s, is_splittable_fn);
+      stack_type s1 = r.first;
+      stack_type s2 = r.second;
+      if (empty(s2) || (s1.sp == nullptr)) {
+        return r;
+      }
+      // s2 starts at pf2, in the middle of the chunk cf1
+      frame_header_type* pf2 = s1.sp;
+      chunk_type* cf1 = chunk_of(pf2);
+      // u is the bottom-most frame of s2 above cf1, if any
+      frame_header_type* u = nullptr;
+      frame_header_type* fp = s2.fp;
+      while (chunk_of(fp) != cf1) {
+        chunk_type* c = chunk_of(fp);
+        if (c->hdr.forked) {
+          while (chunk_of(fp->pred) == c) {
+            fp = fp->pred;
+          }
+        } else {
+          fp = (frame_header_type*)chunk_data(c);
+        }
+        u = fp;
+        fp = fp->pred;
+      }
+      chunk_type* cu = (u == nullptr) ? nullptr : chunk_of(u);
+      char* lo = (char*)pf2;
+      char* hi = (char*)((u == nullptr) ? s2.sp : cu->hdr.sp);
+      frame_header_type* lim = (u == nullptr) ? s2.lp : cu->hdr.lp;
+      size_t nb = hi - lo;
+      if (nb > max_szb) {
+        return r;
+      }
+      chunk_type* c = create_chunk(nullptr, nullptr);
+      char* d = chunk_data(c);
+      std::ptrdiff_t delta = d - lo;
+      memcpy(d, lo, nb);
+      auto reloc = [&] (frame_header_type* p) {
+        if (((char*)p >= lo) && ((char*)p < hi)) {
+          p = (frame_header_type*)((char*)p + delta);
+        }
+        return p;
+      };
+      frame_header_type* top = reloc(fp);
+      for (frame_header_type* f = top; f != nullptr; f = f->pred) {
+        f->pred = reloc(f->pred);
+        f->ext.pred = reloc(f->ext.pred);
+        f->ext.succ = reloc(f->ext.succ);
+        join_relocate(f, reloc, join_counter_tag());
+        relocate_fn(frame_data(f), delta);
+      }
+      s2.mhd = reloc(s2.mhd);
+      s2.mtl = reloc(s2.mtl);
+      for (frame_header_type* m = s2.mhd; m != nullptr; m = m->ext.succ) {
+        if (chunk_of(m) != c) {
+          m->ext.pred = reloc(m->ext.pred);
+          break;
+        }
+      }
+      auto end = (frame_header_type*)((char*)c + K);
+      if (u == nullptr) {
+        s2.fp = top;
+        s2.sp = (frame_header_type*)(d + nb);
+        s2.lp = end;
+      } else {
+        u->pred = top;
+        cu->hdr.sp = (frame_header_type*)(d + nb);
+        cu->hdr.lp = end;
+      }
+      s1.lp = lim;
+      decr_refcount(cf1);
+      return std::make_pair(s1, s2);
+    }
+    
     template <class Is_splittable_fn>
     std::pair<stack_type, stack_type> split_mark(stack_type s, const Is_splittable_fn& is_splittable_fn) {
+      assert(! persistent);
       stack_type s1 = s;
       stack_type s2 = create_stack();
       frame_header_type* pf = s.mhd;
@@ -611,22 +1671,99 @@ namespace cactus_stack {
       pf->ext.succ = nullptr;
       pg->ext.pred = nullptr;
       pg->pred = nullptr;
+      join_fork(pf, pg, join_counter_tag());
       s1.fp = pf;
       s1.sp = nullptr;
-      s1.lp = nullptr;
       s1.mtl = pf;
+      s1.par.nb_marks = 1;
       s2 = s;
       pg->ext.llt = Loop_link_none;
       s2.mhd = pg;
+      s2.par.nb_marks = s.par.nb_marks - 1;
+      s2.par.nb_iters = 0;
       chunk_type* cpf = chunk_of(pf);
       if (cpf == chunk_of(pg)) {
         incr_refcount(cpf);
+        cpf->hdr.forked = true;
+        s1.sp = pg;
       }
+      s1.lp = s1.sp;
       s1 = try_pop_mark_back(s1, is_splittable_fn);
       s2 = try_pop_mark_front(s2, is_splittable_fn);
       return std::make_pair(s1, s2);
     }
     
+    /* Gives back to s1 the space of its top chunk that was handed
+     * over to s2 by fork_mark or split_mark, once s2 has been fully
+     * unwound. The unwinding of s2 has already released its
+     * reference on the chunk; when s1 is the only remaining owner,
+     * nothing lives above the top frame of s1 in that chunk, and
+     * the allocation region of s1 is extended to the end of it.
+     */
+    stack_type join_mark(stack_type s1, stack_type s2) {
+      assert(empty(s2));
+      (void)s2;
+      stack_type t = s1;
+      if (empty(s1) || (s1.sp == nullptr)) {
+        return t;
+      }
+      chunk_type* c = chunk_of(s1.fp);
+      if ((chunk_of(s1.sp) != c) || (c->hdr.refcount.load() != 1)) {
+        return t;
+      }
+      t.lp = (frame_header_type*)((char*)c + K);
+      return t;
+    }
+    
+    /* Returns true when the children of the top frame of s that
+     * fork_mark or split_mark forked off have all been popped, by
+     * pop_back, pop_until or destroy_stack, in which case all that
+     * they did before being popped is visible to the caller. The
+     * top frame must not be popped before then. Always true when
+     * join counters are off, as they are by default; see
+     * CACTUS_STACK_JOIN_COUNTER.
+     */
+    bool try_join(stack_type s) {
+      return try_join(s.fp, join_counter_tag());
+    }
+    
+    /* In persistent mode, returns a copy of s, in constant time. The
+     * copy and s share their frames, and each one may be pushed to
+     * and popped from as a stack of its own, until it is destroyed
+     * or released by release_stack. Pushes on either one place their
+     * frames in fresh chunks for as long as the chunk of its top
+     * frame is shared. A frame that is shared is passed to
+     * destruct_fn by each stack that pops it, hence frames of
+     * persistent stacks should be trivially destructible.
+     */
+    stack_type snapshot(stack_type s) {
+      assert(persistent);
+      // the links of the mark list are stored in the frames
+      assert(empty_mark(s));
+      if (! empty(s)) {
+        incr_refcount(chunk_of(s.fp));
+      }
+      return s;
+    }
+
+    /* In persistent mode, drops the stack s without visiting its
+     * frames: releases the chunk of its top frame, if no other stack
+     * or chunk uses it, then, likewise, the chunk below, and so on.
+     */
+    void release_stack(stack_type s) {
+      assert(persistent);
+      frame_header_type* fp = s.fp;
+      while (fp != nullptr) {
+        chunk_type* c = chunk_of(fp);
+        bool last = (c->hdr.refcount.load() == 1);
+        fp = ((frame_header_type*)chunk_data(c))->pred;
+        decr_refcount(c);
+        if (! last) {
+          break;
+        }
+      }
+    }
+    
     template <int frame_szb, class Initialize_fn, class Is_splittable_fn>
     stack_type create_stack(parent_link_type ty,
                             const Initialize_fn& initialize_fn,
@@ -638,9 +1775,317 @@ namespace cactus_stack {
       return s;
     }
     
+#if __cplusplus >= 201703L
+
+    /* A memory resource that serves allocations from the space that
+     * follows the frame on top of s at construction time, using
+     * extend_back, and from upstream when that space runs out.
+     * Allocations may only be requested while that frame is on top
+     * of s. Space taken from the stack is reclaimed when the frame
+     * is popped, or immediately, alignment padding included, when the
+     * most recent allocation is deallocated before any other one.
+     */
+    class frame_resource : public std::pmr::memory_resource {
+    private:
+
+      stack_type& s;
+
+      frame_header_type* fp;
+
+      std::pmr::memory_resource* upstream;
+
+      // most recent allocation taken from the stack, and the value of
+      // s.sp before it
+      void* last_p = nullptr;
+      frame_header_type* last_sp = nullptr;
+
+    public:
+
+      frame_resource(stack_type& s,
+                     std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+        : s(s), fp(s.fp), upstream(upstream) {
+        assert(! empty(s));
+      }
+
+    protected:
+
+      void* do_allocate(size_t nb, size_t align) override {
+        assert(s.fp == fp);
+        auto r = extend_back(s, nb, align);
+        if (r.second == nullptr) {
+          return upstream->allocate(nb, align);
+        }
+        last_p = r.second;
+        last_sp = s.sp;
+        s = r.first;
+        return r.second;
+      }
+
+      void do_deallocate(void* p, size_t nb, size_t align) override {
+        if (chunk_of(p) != chunk_of(fp)) {
+          upstream->deallocate(p, nb, align);
+          return;
+        }
+        if (p != last_p) {
+          return;
+        }
+        uintptr_t a = alignof(frame_header_type);
+        uintptr_t sp = ((uintptr_t)p + nb + (a - 1)) & ~(a - 1);
+        if ((s.fp == fp) && (sp == (uintptr_t)s.sp)) {
+          s.sp = last_sp;
+        }
+        last_p = nullptr;
+      }
+
+      bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+      }
+
+    };
+
+#endif
+
+#if __cplusplus >= 202002L
+
+    /* A stack that holds the frames of C++20 coroutines whose
+     * promise type derives from coroutine_promise or, for spawned
+     * coroutines, from spawned_coroutine_promise. Coroutine frames
+     * are pushed on the stack when the coroutines are created and
+     * popped when they are destroyed, so the lifetimes of the
+     * coroutines that share a stack must nest. A frame that is
+     * destroyed while another frame is above it is popped along
+     * with the last frame above it. Frames too large to fit in a
+     * chunk come from the global operator new instead.
+     *
+     * The frames of spawned coroutines are linked with
+     * Parent_link_async, and fork moves the oldest one, along with
+     * the frames above it, to another coroutine_stack, from which
+     * they are then popped as they are destroyed. Once all of them
+     * are, join gives the space back to the stack they were forked
+     * from. The frame below the ones forked off must not be
+     * destroyed before then. The coroutines forked off keep the
+     * stack they were created with as their argument, so their
+     * callees have to be created on the other stack explicitly.
+     */
+    class coroutine_stack {
+    private:
+
+      using slot_type = struct {
+        coroutine_stack* owner;
+        bool dead;
+      };
+
+      static constexpr
+      size_t align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+      static constexpr
+      size_t pad = (align > alignof(frame_header_type)) ? align - alignof(frame_header_type) : 0;
+
+      static
+      size_t frame_szb(size_t nb) {
+        size_t a = alignof(frame_header_type);
+        return (pad + sizeof(slot_type) + nb + (a - 1)) & ~(a - 1);
+      }
+
+      static
+      bool fits(size_t nb) {
+        return sizeof(chunk_header_type) + sizeof(frame_header_type) + frame_szb(nb) <= (size_t)K;
+      }
+
+      // address of the coroutine frame in the frame whose data is _ar
+      static
+      char* coroutine_frame_of(char* _ar) {
+        uintptr_t p = (uintptr_t)_ar + sizeof(slot_type);
+        return (char*)((p + (align - 1)) & ~(uintptr_t)(align - 1));
+      }
+
+      static
+      slot_type* slot_of(char* p) {
+        return (slot_type*)(p - sizeof(slot_type));
+      }
+
+    public:
+
+      stack_type s;
+
+      coroutine_stack()
+        : s(create_stack()) { }
+
+      coroutine_stack(const coroutine_stack&) = delete;
+
+      coroutine_stack& operator=(const coroutine_stack&) = delete;
+
+      ~coroutine_stack() {
+        assert(empty(s));
+      }
+
+      void* allocate(size_t nb, parent_link_type ty) {
+        if (! fits(nb)) {
+          return ::operator new(nb);
+        }
+        char* p = nullptr;
+        s = push_back(s, frame_szb(nb), ty, [&] (char* _ar) {
+          p = coroutine_frame_of(_ar);
+          new (slot_of(p)) slot_type({ this, false });
+        }, [] (char*) {
+          return false;
+        });
+        return p;
+      }
+
+      static
+      void deallocate(void* p, size_t nb) {
+        if (! fits(nb)) {
+          ::operator delete(p);
+          return;
+        }
+        slot_type* sl = slot_of((char*)p);
+        sl->dead = true;
+        // the stack that holds the frame now, which fork keeps up to date
+        stack_type& s = sl->owner->s;
+        while ((! empty(s)) && slot_of(coroutine_frame_of(frame_data(s.fp)))->dead) {
+          s = pop_back(s, [] (char*, shared_frame_type) { });
+        }
+      }
+
+      /* Moves the frame of the oldest spawned coroutine that has a
+       * frame below it, and all frames above it, to thief, which
+       * must be empty. Returns false, and moves nothing, if there is
+       * no such frame. Takes time linear in the number of frames
+       * moved.
+       */
+      bool fork(coroutine_stack& thief) {
+        assert(empty(thief.s));
+        auto ss = fork_mark(s, [] (char*) {
+          return false;
+        });
+        if (empty(ss.second)) {
+          return false;
+        }
+        s = ss.first;
+        thief.s = ss.second;
+        for (frame_header_type* f = thief.s.fp; f != nullptr; f = f->pred) {
+          slot_of(coroutine_frame_of(frame_data(f)))->owner = &thief;
+        }
+        return true;
+      }
+
+      // once all frames forked off to thief are destroyed
+      void join(coroutine_stack& thief) {
+        assert(empty(thief.s));
+        s = join_mark(s, thief.s);
+      }
+
+    };
+
+    /* A mixin for promise types, which makes a coroutine allocate its
+     * frame from the coroutine_stack passed as its first argument,
+     * for coroutines that are awaited by their caller.
+     */
+    class coroutine_promise {
+    public:
+
+      template <class... Args>
+      static
+      void* operator new(size_t nb, coroutine_stack& cs, Args&...) {
+        return cs.allocate(nb, Parent_link_sync);
+      }
+
+      static
+      void operator delete(void* p, size_t nb) {
+        coroutine_stack::deallocate(p, nb);
+      }
+
+      /* The placement form that matches operator new, for a
+       * new-expression whose constructor throws. Coroutines always
+       * free their frames with the usual form above.
+       */
+      template <class... Args>
+      static
+      void operator delete(void* p, size_t nb, coroutine_stack&, Args&...) {
+        coroutine_stack::deallocate(p, nb);
+      }
+
+    };
+
+    /* A mixin for the promise types of coroutines that are spawned,
+     * whose frames coroutine_stack::fork may move to another stack.
+     */
+    class spawned_coroutine_promise : public coroutine_promise {
+    public:
+
+      template <class... Args>
+      static
+      void* operator new(size_t nb, coroutine_stack& cs, Args&...) {
+        return cs.allocate(nb, Parent_link_async);
+      }
+
+    };
+
+#endif
+
     /* Stack */
     /*------------------------------*/
 
+    /*------------------------------*/
+    /* Parallelism estimate */
+
+    /* Computes from scratch what s.par holds, by a walk over the
+     * mark list of s, in which nb_iters_fn(_ar) gives the number of
+     * iterations that each splittable frame has left. Takes time
+     * linear in the number of marks, e.g., for checking s.par.
+     */
+    template <class Nb_iters_fn, class Is_splittable_fn>
+    parallelism_type estimate_parallelism(stack_type s,
+                                          const Nb_iters_fn& nb_iters_fn,
+                                          const Is_splittable_fn& is_splittable_fn) {
+      parallelism_type p = { 0, 0 };
+      for (frame_header_type* m = s.mhd; m != nullptr; m = m->ext.succ) {
+        p.nb_marks++;
+        char* _ar = frame_data(m);
+        if (is_splittable_fn(_ar)) {
+          p.nb_iters += nb_iters_fn(_ar);
+        }
+      }
+      return p;
+    }
+
+    /* A summary of the parallelism of a stack, written by the thread
+     * that owns the stack and read by any other thread. Stores and
+     * loads are relaxed, i.e., plain moves on x86, and the two fields
+     * may be read from different publications: the summary is only
+     * a hint, e.g., for a thief to pick a victim.
+     */
+    class published_parallelism_type {
+    private:
+
+      std::atomic<int> nb_marks;
+
+      std::atomic<long> nb_iters;
+
+    public:
+
+      published_parallelism_type() {
+        publish({ 0, 0 });
+      }
+
+      void publish(parallelism_type p) {
+        nb_marks.store(p.nb_marks, std::memory_order_relaxed);
+        nb_iters.store(p.nb_iters, std::memory_order_relaxed);
+      }
+
+      parallelism_type load() const {
+        return {
+          nb_marks.load(std::memory_order_relaxed),
+          nb_iters.load(std::memory_order_relaxed)
+        };
+      }
+
+    };
+
+    /* Parallelism estimate */
+    /*------------------------------*/
+
   } // end namespace
 } // end namespace
 
@@ -0,0 +1,1711 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <array>
+#include <algorithm>
+#include <utility>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <assert.h>
+#include <chrono>
+#include <climits>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#ifdef __linux__
+#include <sys/mman.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CACTUS_STACK_IO_URING 1
+#endif
+#endif
+#endif
+
+#include "cactus-plus.hpp"
+
+#ifndef _CACTUS_STACK_RUNTIME_H_
+#define _CACTUS_STACK_RUNTIME_H_
+
+/* A work-stealing runtime in which each worker keeps its cactus
+ * stack, and thus its mark list, private. An idle worker sends a
+ * steal request to the request cell of a victim. The victim polls
+ * its request cell every polling_interval scheduling steps, and
+ * serves a request by splitting off work itself, with fork_mark or
+ * by splitting a loop, and by writing the resulting stack to the
+ * response cell of the thief. As a consequence, push_back and
+ * pop_back need no fences.
+ *
+ * A frame is an object deriving from frame, placed in a frame of the
+ * cactus stack. The worker repeatedly calls the run method of the
+ * frame on top of its stack, which, each time, does one step: it
+ * spawns or calls a child frame, waits for its spawned children
+ * with sync, or pops itself with finish.
+ */
+
+namespace cactus_stack {
+  namespace runtime {
+
+    class worker;
+
+    /*------------------------------*/
+    /* Frame */
+
+    class future_base;
+
+    class frame {
+    public:
+
+      // frame on top of the stack at the time this frame was pushed
+      frame* parent = nullptr;
+
+      // cell of the future computed by the frame, if any, see future_frame
+      future_base* fut = nullptr;
+
+      // cells of the futures spawned by the frame and placed in it
+      future_base* futures = nullptr;
+
+      // one plus the number of children stolen from the frame that
+      // did not finish yet
+      std::atomic<int> pending;
+
+      // set once a child of the frame was stolen since its last sync
+      bool has_stolen = false;
+
+      // stack of the frame while it waits for its stolen children
+      plus::stack_type suspended;
+
+      // iterations of the frame counted in the stack that holds it
+      long reported_iters = 0;
+
+      // set in frames that stay in place once finished, until their
+      // parent reads and destroys them, see reduce_frame
+      bool kept = false;
+
+      frame() {
+        pending.store(1, std::memory_order_relaxed);
+      }
+
+      // a copy of a frame starts with no children
+      frame(const frame&) : frame() { }
+
+      virtual ~frame() { }
+
+      virtual void run(worker& w) = 0;
+
+      /* Frames that may split off part of their work, e.g., loops.
+       * A frame whose splittable() changes once it is pushed reports
+       * it by worker::set_splittable, as the mark list of the stack is
+       * never rescanned.
+       */
+      virtual bool splittable() {
+        return false;
+      }
+
+      /* Moves part of the work of the frame to a frame placed on a
+       * new stack, which is returned, with the mark list of that
+       * stack up to date. The new frame has the frame as parent.
+       */
+      virtual plus::stack_type split() {
+        assert(false);
+        return plus::create_stack();
+      }
+
+      // for splittable frames, the amount of work left to split off
+      virtual long nb_iters() {
+        return 0;
+      }
+
+      // for the frames of futures, moves the result to the cell
+      virtual void deliver() { }
+
+    };
+
+    namespace {
+
+      auto is_splittable_fn = [] (char* p) {
+        return ((frame*)p)->splittable();
+      };
+
+      auto destruct_fn = [] (char* p, plus::shared_frame_type) {
+        ((frame*)p)->~frame();
+      };
+
+      /* Brings the number of iterations that s counts for its frame
+       * f up to date, in constant time.
+       */
+      plus::stack_type update_reported_iters(plus::stack_type s, frame* f) {
+        long n = f->splittable() ? f->nb_iters() : 0;
+        s = plus::add_nb_iters(s, n - f->reported_iters);
+        f->reported_iters = n;
+        return s;
+      }
+
+      /* Gives u, just forked off another stack, the count of the
+       * iterations of its frames, which fork_marks leaves with the
+       * stack that remains, and adds that count to nb_moved.
+       */
+      plus::stack_type take_reported_iters(plus::stack_type u, long& nb_moved) {
+        long n = 0;
+        for (auto m = u.mhd; m != nullptr; m = m->ext.succ) {
+          n += plus::frame_data<frame>(m)->reported_iters;
+        }
+        nb_moved += n;
+        return plus::add_nb_iters(u, n);
+      }
+
+      /* Records that the bottom frame of t, a child of the top frame
+       * of s, went to another stack, unless it is the frame of a
+       * future, which its parent does not sync with.
+       */
+      void stolen_from(plus::stack_type s, plus::stack_type t) {
+        if (plus::frame_data<frame>(t.fp)->fut != nullptr) {
+          return;
+        }
+        frame* p = plus::frame_data<frame>(s.fp);
+        p->has_stolen = true;
+        p->pending.fetch_add(1, std::memory_order_relaxed);
+      }
+
+    } // end namespace
+
+    template <class T, class ... Args>
+    plus::stack_type create_stack(frame* parent, Args&& ... args) {
+      return plus::create_stack<sizeof(T)>(plus::Parent_link_async, [&] (char* p) {
+        frame* f = new (p) T(std::forward<Args>(args)...);
+        f->parent = parent;
+      }, is_splittable_fn);
+    }
+
+    /* Frame */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Future */
+
+    using future_state_type = enum future_state_enum {
+      Future_running, Future_waiting, Future_done
+    };
+
+    // who holds the memory of the cell of a future placed in a frame
+    using future_hold_type = enum future_hold_enum {
+      Hold_frame, Hold_escaped, Hold_touched
+    };
+
+    /* The cell of a future, which holds its state and, in
+     * future_cell, its result. worker::spawn_future places the cell
+     * in the frame that spawns the future, which owns its memory,
+     * unless the cell escapes: if the future is not touched by the
+     * time that frame finishes, the cell takes a reference on its
+     * chunk, which the stack then stops allocating from, and which
+     * lives on until the future is touched. When the frame has no
+     * room left for it, the cell sits alone on a stack of its own.
+     */
+    class future_base {
+    public:
+
+      std::atomic<int> state;
+
+      // frame suspended until the future is done, if any
+      frame* waiter = nullptr;
+
+      // set when the cell sits on a stack of its own
+      bool own_stack = false;
+
+      std::atomic<int> hold;
+
+      // next cell placed in the same frame
+      future_base* next = nullptr;
+
+      future_base() {
+        state.store(Future_running, std::memory_order_relaxed);
+        hold.store(Hold_frame, std::memory_order_relaxed);
+      }
+
+      // called once the future is touched, after which the cell is dead
+      void touch() {
+        plus::chunk_type* c = plus::chunk_of(this);
+        if (own_stack || (hold.exchange(Hold_touched, std::memory_order_acq_rel) == Hold_escaped)) {
+          plus::decr_refcount(c);
+        }
+      }
+
+      // called by the frame holding the cell as it finishes
+      bool escape() {
+        plus::chunk_type* c = plus::chunk_of(this);
+        plus::incr_refcount(c);
+        if (hold.exchange(Hold_escaped, std::memory_order_acq_rel) == Hold_touched) {
+          plus::decr_refcount(c);
+          return false;
+        }
+        return true;
+      }
+
+    };
+
+    template <class T>
+    class future_cell : public future_base {
+    public:
+
+      T result;
+
+    };
+
+    /* The frame of a future, which stores its result in result
+     * before it calls finish. worker::spawn_future pushes the frame
+     * on the current stack, as an async child of the frame on top,
+     * and the result is then moved to the cell of the future as the
+     * frame finishes.
+     */
+    template <class T>
+    class future_frame : public frame {
+    public:
+
+      using value_type = T;
+
+      T result;
+
+      void deliver() override {
+        ((future_cell<T>*)fut)->result = std::move(result);
+      }
+
+    };
+
+    /* A handle on a future, which may be passed to any frame. The
+     * future must be touched exactly once: a frame first waits for
+     * it with worker::await, which may suspend the frame, and then,
+     * in its next step, takes the result with get.
+     */
+    template <class T>
+    class future {
+    public:
+
+      future_cell<T>* c = nullptr;
+
+      future() { }
+
+      future(future_cell<T>* c)
+        : c(c) { }
+
+      bool ready() const {
+        return c->state.load(std::memory_order_acquire) == Future_done;
+      }
+
+      // moves out the result and releases the cell
+      T get() {
+        assert(ready());
+        T r = std::move(c->result);
+        c->result.~T();
+        c->touch();
+        c = nullptr;
+        return r;
+      }
+
+    };
+
+    /* Future */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Topology */
+
+    // distance between two cpus, from the closest to the farthest
+    using topology_level_type = enum topology_level_enum {
+      Level_smt, Level_llc, Level_socket, Level_remote
+    };
+
+    static constexpr
+    int nb_topology_levels = 4;
+
+    class cpu_topology {
+    public:
+
+      // for each cpu, the smallest cpu of its core, of the cpus
+      // sharing its last-level cache, and its package
+      std::vector<int> core, llc, package;
+
+      int nb_cpus() const {
+        return (int)core.size();
+      }
+
+      topology_level_type level(int a, int b) const {
+        if (core[a] == core[b]) {
+          return Level_smt;
+        }
+        if (llc[a] == llc[b]) {
+          return Level_llc;
+        }
+        if (package[a] == package[b]) {
+          return Level_socket;
+        }
+        return Level_remote;
+      }
+
+    };
+
+    namespace {
+
+      bool read_line(const std::string& path, std::string& line) {
+        std::ifstream f(path);
+        return (bool)std::getline(f, line);
+      }
+
+      // returns the smallest cpu of a list such as "0-3,8-11", or -1
+      int min_of_cpu_list(const std::string& list) {
+        std::istringstream in(list);
+        std::string range;
+        int r = -1;
+        while (std::getline(in, range, ',')) {
+          if (range.empty()) {
+            continue;
+          }
+          int lo = std::stoi(range.substr(0, range.find('-')));
+          r = (r == -1) ? lo : std::min(r, lo);
+        }
+        return r;
+      }
+
+    } // end namespace
+
+    /* Reads the topology of the cpus 0, 1, ... from sysfs, stopping
+     * at the first cpu whose topology cannot be read. Information
+     * that is missing, e.g., the cache hierarchy on some virtual
+     * machines, is taken to put the cpu on its own.
+     */
+    static inline
+    cpu_topology read_cpu_topology(const std::string& root = "/sys/devices/system/cpu") {
+      cpu_topology t;
+      for (int cpu = 0; ; cpu++) {
+        std::string dir = root + "/cpu" + std::to_string(cpu);
+        std::string line;
+        if (! read_line(dir + "/topology/physical_package_id", line)) {
+          break;
+        }
+        t.package.push_back(std::stoi(line));
+        int core = cpu;
+        if (read_line(dir + "/topology/thread_siblings_list", line)) {
+          core = std::max(0, min_of_cpu_list(line));
+        }
+        t.core.push_back(core);
+        int llc = cpu;
+        int llc_level = 0;
+        for (int i = 0; ; i++) {
+          std::string index = dir + "/cache/index" + std::to_string(i);
+          if (! read_line(index + "/level", line)) {
+            break;
+          }
+          int level = std::stoi(line);
+          if ((level >= llc_level) && read_line(index + "/shared_cpu_list", line)) {
+            llc_level = level;
+            llc = std::max(0, min_of_cpu_list(line));
+          }
+        }
+        t.llc.push_back(llc);
+      }
+      return t;
+    }
+
+    /* Topology */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Victim selection */
+
+    /* The other workers, as seen by a thief, by distance in the
+     * topology. The thief starts with its closest victims, moves on
+     * to the next level after threshold[level] failed attempts in a
+     * row at a level, and comes back to the closest level once it
+     * steals.
+     */
+    class victim_selector {
+    public:
+
+      std::vector<int> victims[nb_topology_levels];
+
+      // level at which the next steal attempt is made
+      int level = 0;
+
+      int nb_failed = 0;
+
+      unsigned int rng;
+
+      victim_selector(unsigned int seed)
+        : rng(seed) { }
+
+      void add_victim(int j, topology_level_type l) {
+        victims[l].push_back(j);
+      }
+
+      // picks a victim at the current level, or at the next level that has one
+      int random_victim() {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        while (victims[level].empty()) {
+          level = (level + 1) % nb_topology_levels;
+          nb_failed = 0;
+        }
+        auto& vs = victims[level];
+        return vs[rng % (unsigned int)vs.size()];
+      }
+
+      void failed(const int* threshold) {
+        if (++nb_failed >= threshold[level]) {
+          level = std::min(level + 1, nb_topology_levels - 1);
+          nb_failed = 0;
+        }
+      }
+
+      // returns the level at which the steal succeeded
+      topology_level_type succeeded() {
+        auto l = (topology_level_type)level;
+        level = 0;
+        nb_failed = 0;
+        return l;
+      }
+
+    };
+
+    /* Gives worker i all other workers as victims, with worker j
+     * taken to run on cpu j modulo the number of cpus of topo. All
+     * victims are remote when topo is empty.
+     */
+    static inline
+    void add_victims(victim_selector& sel, int i, int nb_workers, const cpu_topology& topo) {
+      int nb_cpus = topo.nb_cpus();
+      for (int j = 0; j < nb_workers; j++) {
+        if (i == j) {
+          continue;
+        }
+        topology_level_type l = Level_remote;
+        if (nb_cpus > 0) {
+          l = topo.level(i % nb_cpus, j % nb_cpus);
+        }
+        sel.add_victim(j, l);
+      }
+    }
+
+    /* Victim selection */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Runtime */
+
+    using victim_selection_type = enum victim_selection_enum {
+      Victim_random, Victim_hierarchical,
+      // the victim whose published parallelism is the largest
+      Victim_richest
+    };
+
+    using config_type = struct config_struct {
+      int nb_workers;
+      // number of scheduling steps between two polls of the request cell
+      int polling_interval;
+      victim_selection_type victim_selection;
+      // number of failed steal attempts at each level of the topology
+      // after which a thief moves on to the next level
+      int escalation_threshold[nb_topology_levels];
+      // sysfs directory of the cpus, read for Victim_hierarchical
+      std::string topology_root;
+      // binds worker i to cpu i modulo the number of cpus
+      bool pin_workers;
+      // number of failed steal attempts in a row after which a thief
+      // parks, or zero to never park
+      int park_threshold;
+      // longest time, in microseconds, that a worker stays parked
+      // without being woken up
+      int park_timeout;
+      // number of parked workers woken up by the push of a mark frame
+      int nb_wakeups;
+      // largest number of stacks forked off by a victim for one thief,
+      // which gets up to half of the async marks of the victim
+      int max_nb_marks_per_steal;
+      // number of entries of the submission queue of the reactor, which
+      // also bounds the number of reads and writes in flight, or zero to
+      // perform them synchronously
+      int io_queue_depth;
+    };
+
+    static inline
+    config_type default_config() {
+      config_type c;
+      c.nb_workers = std::max(1, (int)std::thread::hardware_concurrency());
+      c.polling_interval = 64;
+      c.victim_selection = Victim_random;
+      c.escalation_threshold[Level_smt] = 2;
+      c.escalation_threshold[Level_llc] = 4;
+      c.escalation_threshold[Level_socket] = 8;
+      c.escalation_threshold[Level_remote] = 1;
+      c.topology_root = "/sys/devices/system/cpu";
+      c.pin_workers = false;
+      c.park_threshold = 128;
+      c.park_timeout = 1000;
+      c.nb_wakeups = 2;
+      c.max_nb_marks_per_steal = 1;
+      c.io_queue_depth = 64;
+      return c;
+    }
+
+    using stats_type = struct stats_struct {
+      long nb_steals;
+      long nb_splits;
+      long nb_rejected;
+      // steals obtained by the thief at each level of the topology
+      long nb_steals_at_level[nb_topology_levels];
+      long nb_parks;
+    };
+
+    /* Waits for as long as timeout microseconds, unless woken up by
+     * futex_wake on addr, or unless *addr differs from val on entry.
+     * Without futexes, simply sleeps.
+     */
+    static inline
+    void futex_wait(std::atomic<int>& addr, int val, int timeout) {
+#ifdef __linux__
+      struct timespec ts;
+      ts.tv_sec = timeout / 1000000;
+      ts.tv_nsec = (timeout % 1000000) * 1000L;
+      syscall(SYS_futex, (int*)&addr, FUTEX_WAIT_PRIVATE, val, &ts, nullptr, 0);
+#else
+      if (addr.load() == val) {
+        std::this_thread::sleep_for(std::chrono::microseconds(timeout));
+      }
+#endif
+    }
+
+    static inline
+    void futex_wake(std::atomic<int>& addr, int nb) {
+#ifdef __linux__
+      syscall(SYS_futex, (int*)&addr, FUTEX_WAKE_PRIVATE, nb, nullptr, nullptr, 0);
+#endif
+    }
+
+    /* A reactor for file reads and writes, built on an io_uring
+     * instance that the workers share. A frame that starts a read or
+     * write parks the stack that it is on, which is all that its
+     * continuation takes, in a slot of the completion table, whose
+     * index is the user data of the submission. The worker that reaps
+     * the completion writes the result to its destination and takes
+     * the stack back, to run or to be stolen. Reads and writes are
+     * performed synchronously, by pread and pwrite, when no io_uring
+     * can be set up or when the table is full.
+     */
+    class reactor {
+    private:
+
+      using slot_type = struct {
+        plus::stack_type s;
+        int* res;
+        // next free slot, or -1
+        int next;
+      };
+
+      std::mutex lock;
+
+      std::vector<slot_type> table;
+
+      int free_slots = -1;
+
+      std::atomic<int> nb_pending;
+
+      int fd = -1;
+
+#ifdef CACTUS_STACK_IO_URING
+      void* sq_ring = MAP_FAILED;
+      size_t sq_ring_szb = 0;
+      void* cq_ring = MAP_FAILED;
+      size_t cq_ring_szb = 0;
+      struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+      size_t sqes_szb = 0;
+      unsigned* sq_tail;
+      unsigned* sq_mask;
+      unsigned* sq_array;
+      unsigned* cq_head;
+      unsigned* cq_tail;
+      unsigned* cq_mask;
+      struct io_uring_cqe* cqes;
+
+      template <class T>
+      static T* at(void* ring, unsigned off) {
+        return (T*)((char*)ring + off);
+      }
+
+      bool setup(unsigned depth) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+        if (fd < 0) {
+          return false;
+        }
+        sq_ring_szb = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_szb = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+          sq_ring_szb = cq_ring_szb = std::max(sq_ring_szb, cq_ring_szb);
+        }
+        sq_ring = mmap(nullptr, sq_ring_szb, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+          return false;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+          cq_ring = sq_ring;
+        } else {
+          cq_ring = mmap(nullptr, cq_ring_szb, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+          if (cq_ring == MAP_FAILED) {
+            return false;
+          }
+        }
+        sqes_szb = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_szb, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+          return false;
+        }
+        sq_tail = at<unsigned>(sq_ring, p.sq_off.tail);
+        sq_mask = at<unsigned>(sq_ring, p.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_ring, p.sq_off.array);
+        cq_head = at<unsigned>(cq_ring, p.cq_off.head);
+        cq_tail = at<unsigned>(cq_ring, p.cq_off.tail);
+        cq_mask = at<unsigned>(cq_ring, p.cq_off.ring_mask);
+        cqes = at<struct io_uring_cqe>(cq_ring, p.cq_off.cqes);
+        // as many slots as submissions, which the completion queue,
+        // twice as large, always has room for
+        table.resize(p.sq_entries);
+        for (int i = 0; i < (int)table.size(); i++) {
+          table[i].next = free_slots;
+          free_slots = i;
+        }
+        return true;
+      }
+
+      void teardown() {
+        if (sqes != MAP_FAILED) {
+          munmap(sqes, sqes_szb);
+        }
+        if ((cq_ring != MAP_FAILED) && (cq_ring != sq_ring)) {
+          munmap(cq_ring, cq_ring_szb);
+        }
+        if (sq_ring != MAP_FAILED) {
+          munmap(sq_ring, sq_ring_szb);
+        }
+        if (fd >= 0) {
+          close(fd);
+        }
+        table.clear();
+        free_slots = -1;
+        fd = -1;
+      }
+#endif
+
+    public:
+
+      reactor(int depth) {
+        nb_pending.store(0);
+#ifdef CACTUS_STACK_IO_URING
+        if ((depth > 0) && ! setup((unsigned)depth)) {
+          teardown();
+        }
+#endif
+      }
+
+      reactor(const reactor&) = delete;
+
+      reactor& operator=(const reactor&) = delete;
+
+      ~reactor() {
+        assert(nb_pending.load() == 0);
+#ifdef CACTUS_STACK_IO_URING
+        teardown();
+#endif
+      }
+
+      bool has_pending() const {
+        return nb_pending.load(std::memory_order_relaxed) > 0;
+      }
+
+      /* Submits a read, when write is false, or a write of nb bytes at
+       * offset off of the file fd, and parks s, which is resumed with
+       * the result in *res, by the worker that reaps the completion.
+       * Returns false, with nothing submitted, if no slot is free or
+       * if the kernel does not take the submission.
+       */
+      bool submit(bool write, int fd, void* buf, unsigned nb, uint64_t off,
+                  int* res, plus::stack_type s) {
+#ifdef CACTUS_STACK_IO_URING
+        std::lock_guard<std::mutex> g(lock);
+        if (free_slots < 0) {
+          return false;
+        }
+        int i = free_slots;
+        free_slots = table[i].next;
+        table[i].s = s;
+        table[i].res = res;
+        unsigned tail = *sq_tail;
+        unsigned k = tail & *sq_mask;
+        struct io_uring_sqe* sqe = &sqes[k];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = nb;
+        sqe->off = off;
+        sqe->user_data = (uint64_t)i;
+        sq_array[k] = k;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        while (syscall(__NR_io_uring_enter, this->fd, 1, 0, 0, nullptr, 0) < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          // EBUSY or EAGAIN, with the entry left in the ring: take it back
+          __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+          table[i].next = free_slots;
+          free_slots = i;
+          return false;
+        }
+        nb_pending.fetch_add(1, std::memory_order_relaxed);
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      /* Calls resume_fn(s) on each parked stack whose read or write has
+       * completed, unless another worker is already reaping.
+       */
+      template <class Resume_fn>
+      void reap(const Resume_fn& resume_fn) {
+#ifdef CACTUS_STACK_IO_URING
+        if (! has_pending()) {
+          return;
+        }
+        std::unique_lock<std::mutex> g(lock, std::try_to_lock);
+        if (! g.owns_lock()) {
+          return;
+        }
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+          struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+          int i = (int)cqe->user_data;
+          *table[i].res = cqe->res;
+          resume_fn(table[i].s);
+          table[i].next = free_slots;
+          free_slots = i;
+          nb_pending.fetch_sub(1, std::memory_order_relaxed);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+#else
+        (void)resume_fn;
+#endif
+      }
+
+    };
+
+    // values of a request cell, other than the id of a thief
+    static constexpr
+    int no_request = -1;
+    static constexpr
+    int blocked = -2;
+
+    // values of the status of a response cell
+    using response_status_type = enum {
+      Response_none, Response_waiting, Response_ready
+    };
+
+    class runtime_state;
+
+    class worker {
+    private:
+
+      friend class runtime_state;
+
+      int id;
+
+      runtime_state& rt;
+
+      plus::stack_type s;
+
+      int nb_steps = 0;
+
+      victim_selector sel;
+
+      // number of failed steal attempts since the last steal or park
+      int nb_idle_attempts = 0;
+
+      // stacks obtained by a steal that the worker has yet to run
+      std::deque<plus::stack_type> ready;
+
+      // stacks forked off by the last start_io
+      std::vector<plus::stack_type> forked;
+
+      frame* top() {
+        return plus::frame_data<frame>(s.fp);
+      }
+
+      template <class T, class ... Args>
+      void push(plus::parent_link_type ty, Args&& ... args) {
+        frame* parent = top();
+        s = plus::push_back<sizeof(T)>(s, ty, [&] (char* p) {
+          frame* f = new (p) T(std::forward<Args>(args)...);
+          f->parent = parent;
+        }, is_splittable_fn);
+        if (s.mtl == s.fp) {
+          report_iters(top());
+          wake_parked();
+        }
+      }
+
+      // wakes up some parked workers, if any, now that there is a new mark
+      void wake_parked();
+
+      void park();
+
+      void resume(frame* f) {
+        f->has_stolen = false;
+        f->pending.store(1, std::memory_order_relaxed);
+        s = plus::join_mark(f->suspended, plus::create_stack());
+      }
+
+      int richest_victim();
+
+      void publish_parallelism();
+
+      void steal_failed();
+
+      void poll();
+
+      void reject_requests();
+
+      void steal();
+
+      void start_io(bool write, int fd, void* buf, unsigned nb, uint64_t off, int* res);
+
+      void reap_io();
+
+    public:
+
+      stats_type stats;
+
+      worker(int id, runtime_state& rt)
+        : id(id), rt(rt), s(plus::create_stack()), sel(1 + id) {
+        stats.nb_steals = 0;
+        stats.nb_splits = 0;
+        stats.nb_rejected = 0;
+        for (int l = 0; l < nb_topology_levels; l++) {
+          stats.nb_steals_at_level[l] = 0;
+        }
+        stats.nb_parks = 0;
+      }
+
+      victim_selector& victims() {
+        return sel;
+      }
+
+      // gives the worker a stack to run, when it has none
+      void adopt(plus::stack_type t) {
+        assert(plus::empty(s));
+        s = t;
+      }
+
+      // pushes a child frame that a thief may take over
+      template <class T, class ... Args>
+      void spawn(Args&& ... args) {
+        push<T>(plus::Parent_link_async, std::forward<Args>(args)...);
+      }
+
+      // pushes a child frame that always runs on the current stack
+      template <class T, class ... Args>
+      void call(Args&& ... args) {
+        push<T>(plus::Parent_link_sync, std::forward<Args>(args)...);
+      }
+
+      /* Lets the frame on top run again only once all of its stolen
+       * children have finished. If some have not, the stack is set
+       * aside in the frame, to be resumed by the thread that
+       * finishes the last one, and the worker goes stealing.
+       */
+      void sync() {
+        frame* f = top();
+        if (! f->has_stolen) {
+          return;
+        }
+        f->suspended = s;
+        s = plus::create_stack();
+        if (f->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          resume(f);
+        }
+      }
+
+      /* Reports that the frame f, on top, has become splittable, when
+       * b is true, or has stopped being so. Frames whose splittable()
+       * changes after they are pushed keep the mark list precise this
+       * way, in constant time, rather than by update_mark_stack.
+       */
+      void set_splittable(frame* f, bool b) {
+        s = plus::set_splittable(s, plus::frame_header_of((char*)f), b, is_splittable_fn);
+      }
+
+      /* Brings the number of iterations that the stack counts for
+       * the frame f up to date. Loop frames call it after each step,
+       * and the worker when it pushes or splits a frame.
+       */
+      void report_iters(frame* f) {
+        s = update_reported_iters(s, f);
+      }
+
+      /* Spawns a future frame of type F, as spawn does, and places
+       * the cell of the future at the end of the frame on top, with
+       * extend_back, or, failing that, alone on a stack of its own.
+       * The future frame then runs right away, and the continuation
+       * of the frame on top is left to thieves.
+       */
+      template <class F, class ... Args>
+      future<typename F::value_type> spawn_future(Args&& ... args) {
+        using cell_type = future_cell<typename F::value_type>;
+        cell_type* c;
+        frame* p = top();
+        auto r = plus::extend_back(s, sizeof(cell_type), alignof(cell_type));
+        if (r.second != nullptr) {
+          s = r.first;
+          c = new (r.second) cell_type();
+          c->next = p->futures;
+          p->futures = c;
+        } else {
+          plus::create_stack<sizeof(cell_type)>(plus::Parent_link_sync, [&] (char* q) {
+            c = new (q) cell_type();
+          }, [] (char*) {
+            return false;
+          });
+          c->own_stack = true;
+        }
+        push<F>(plus::Parent_link_async, std::forward<Args>(args)...);
+        top()->fut = c;
+        return future<typename F::value_type>(c);
+      }
+
+      /* Lets the frame on top run again only once the future x is
+       * done, after which the frame may call x.get(). If x is not
+       * done, the stack is set aside in the frame, to be resumed by
+       * the thread that finishes x, and the worker goes stealing.
+       */
+      template <class T>
+      void await(future<T>& x) {
+        if (x.ready()) {
+          return;
+        }
+        frame* f = top();
+        f->suspended = s;
+        x.c->waiter = f;
+        s = plus::create_stack();
+        int r = Future_running;
+        if (! x.c->state.compare_exchange_strong(r, Future_waiting, std::memory_order_acq_rel)) {
+          // x finished in the meantime
+          s = f->suspended;
+        }
+      }
+
+      /* Reads up to nb bytes at offset off of the file fd into buf,
+       * as pread does, and stores the number of bytes read, or minus
+       * an errno value, in *res. The frame on top runs its next step
+       * only once the read has completed, and the worker, meanwhile,
+       * goes on with other work. As with sync, the frame must return
+       * from its step right after the call.
+       */
+      void read(int fd, void* buf, unsigned nb, uint64_t off, int* res) {
+        start_io(false, fd, buf, nb, off, res);
+      }
+
+      // same as read, for a write, as pwrite does
+      void write(int fd, const void* buf, unsigned nb, uint64_t off, int* res) {
+        start_io(true, fd, (void*)buf, nb, off, res);
+      }
+
+      // pops the frame on top, which is done
+      void finish();
+
+      void run();
+
+    };
+
+    class runtime_state {
+    public:
+
+      config_type config;
+
+      std::atomic<bool> done;
+
+      // futex word, bumped by every wake-up of parked workers
+      std::atomic<int> wake_epoch;
+
+      std::atomic<int> nb_parked;
+
+      class alignas(plus::cache_line_szb) cell_type {
+      public:
+        std::atomic<int> request;
+        std::atomic<int> status;
+        plus::stack_type s;
+        // further stacks, given along with s
+        std::vector<plus::stack_type> ready;
+        // of the worker that owns the cell, when victims are picked by it
+        plus::published_parallelism_type parallelism;
+      };
+
+      std::vector<cell_type> cells;
+
+      reactor io;
+
+      runtime_state(config_type config)
+        : config(config), cells(config.nb_workers), io(config.io_queue_depth) {
+        done.store(false);
+        wake_epoch.store(0);
+        nb_parked.store(0);
+        for (auto& c : cells) {
+          // opened by the worker once it runs, so that no request is lost
+          c.request.store(blocked);
+          c.status.store(Response_none);
+        }
+      }
+
+    };
+
+    void worker::finish() {
+      frame* f = top();
+      bool escaped = false;
+      for (future_base* x = f->futures; x != nullptr; x = x->next) {
+        escaped = x->escape() || escaped;
+      }
+      if (f->fut != nullptr) {
+        future_base* x = f->fut;
+        f->deliver();
+        s = plus::pop_back(s, destruct_fn);
+        if (escaped) {
+          s = plus::end_region(s);
+        }
+        if (x->state.exchange(Future_done, std::memory_order_acq_rel) == Future_waiting) {
+          // the waiter got hold of the future, so the frame below went to a thief
+          assert(plus::empty(s));
+          s = x->waiter->suspended;
+        }
+        return;
+      }
+      frame* parent = f->parent;
+      if (f->kept) {
+        // the frame stays in place, for its parent to read it
+        s = plus::pop_back(s, [] (char*, plus::shared_frame_type) { });
+        assert(plus::empty(s));
+      } else {
+        s = plus::pop_back(s, destruct_fn);
+      }
+      if (escaped) {
+        s = plus::end_region(s);
+      }
+      if (! plus::empty(s)) {
+        return;
+      }
+      if (parent == nullptr) {
+        rt.done.store(true);
+        if (rt.nb_parked.load() > 0) {
+          rt.wake_epoch.fetch_add(1);
+          futex_wake(rt.wake_epoch, INT_MAX);
+        }
+        return;
+      }
+      // the frame was the bottom of a stack that was split off parent
+      if (parent->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        resume(parent);
+      }
+    }
+
+    int worker::richest_victim() {
+      long best = 0;
+      int v = -1;
+      for (auto& vs : sel.victims) {
+        for (int j : vs) {
+          auto p = rt.cells[j].parallelism.load();
+          long w = p.nb_marks + p.nb_iters;
+          if (w > best) {
+            best = w;
+            v = j;
+          }
+        }
+      }
+      return (v < 0) ? sel.random_victim() : v;
+    }
+
+    void worker::publish_parallelism() {
+      if (rt.config.victim_selection != Victim_richest) {
+        return;
+      }
+      auto p = s.par;
+      p.nb_marks += (int)ready.size();
+      rt.cells[id].parallelism.publish(p);
+    }
+
+    void worker::wake_parked() {
+      // a seq_cst load, which is a plain load on x86
+      if (rt.nb_parked.load() == 0) {
+        return;
+      }
+      rt.wake_epoch.fetch_add(1);
+      futex_wake(rt.wake_epoch, rt.config.nb_wakeups);
+    }
+
+    /* The epoch is read before the worker registers as parked, such
+     * that a wake-up that sees the registration bumps the epoch after
+     * that read, and the futex wait then returns at once or is woken
+     * up. A mark pushed before the registration may not wake the
+     * worker up, hence the timeout.
+     */
+    void worker::park() {
+      stats.nb_parks++;
+      int e = rt.wake_epoch.load();
+      rt.nb_parked.fetch_add(1);
+      if (! rt.done.load()) {
+        futex_wait(rt.wake_epoch, e, rt.config.park_timeout);
+      }
+      rt.nb_parked.fetch_sub(1);
+      nb_idle_attempts = 0;
+    }
+
+    /* Parks only the frames above the youngest async mark, if any,
+     * such that the continuations of the spawned ancestors of the
+     * frame may run, here or on thieves, while the frame waits.
+     */
+    void worker::start_io(bool write, int fd, void* buf, unsigned nb, uint64_t off, int* res) {
+      forked.clear();
+      if (s.par.nb_marks > 0) {
+        long nb_moved = 0;
+        s = plus::fork_marks(s, s.par.nb_marks, [&] (plus::stack_type u) {
+          forked.push_back(take_reported_iters(u, nb_moved));
+        }, is_splittable_fn);
+        s = plus::add_nb_iters(s, -nb_moved);
+      }
+      if (! forked.empty()) {
+        stolen_from(s, forked[0]);
+        ready.push_back(s);
+        for (size_t i = 0; i + 1 < forked.size(); i++) {
+          stolen_from(forked[i], forked[i + 1]);
+          ready.push_back(forked[i]);
+        }
+        s = forked.back();
+        wake_parked();
+      }
+      if (rt.io.submit(write, fd, buf, nb, off, res, s)) {
+        // the stack may already be running elsewhere
+        s = plus::create_stack();
+        return;
+      }
+      ssize_t r = write ? pwrite(fd, buf, nb, (off_t)off) : pread(fd, buf, nb, (off_t)off);
+      *res = (r < 0) ? -errno : (int)r;
+    }
+
+    void worker::reap_io() {
+      size_t nb = ready.size();
+      rt.io.reap([&] (plus::stack_type t) {
+        ready.push_back(t);
+      });
+      if (ready.size() > nb + 1) {
+        wake_parked();
+      }
+    }
+
+    void worker::steal_failed() {
+      // completions are reaped only by workers that are awake
+      if ((rt.config.park_threshold > 0) && ! rt.io.has_pending() &&
+          (++nb_idle_attempts >= rt.config.park_threshold)) {
+        park();
+      }
+      sel.failed(rt.config.escalation_threshold);
+    }
+
+    void worker::poll() {
+      auto& cell = rt.cells[id];
+      int r = cell.request.load(std::memory_order_acquire);
+      if (r < 0) {
+        return;
+      }
+      auto& rcell = rt.cells[r];
+      plus::stack_type t = plus::create_stack();
+      if (! ready.empty()) {
+        t = ready.front();
+        ready.pop_front();
+        stats.nb_steals++;
+      } else if (! plus::empty_mark(s)) {
+        frame* m = plus::frame_data<frame>(s.mhd);
+        if (m->splittable()) {
+          /* Not split_mark: that cuts the stack between a loop frame
+           * and its loop child, but a loop frame runs its iterations
+           * in place, with no child, and half of its range has to go
+           * to a new frame in any case, on a stack of its own.
+           */
+          m->has_stolen = true;
+          m->pending.fetch_add(1, std::memory_order_relaxed);
+          t = m->split();
+          t = update_reported_iters(t, plus::frame_data<frame>(t.fp));
+          s = plus::set_splittable(s, s.mhd, m->splittable(), is_splittable_fn);
+          report_iters(m);
+          stats.nb_splits++;
+        } else {
+          int k = 1;
+          if (rt.config.max_nb_marks_per_steal > 1) {
+            k = std::max(1, std::min(s.par.nb_marks / 2, rt.config.max_nb_marks_per_steal));
+          }
+          rcell.ready.clear();
+          long nb_moved = 0;
+          s = plus::fork_marks(s, k, [&] (plus::stack_type u) {
+            rcell.ready.push_back(take_reported_iters(u, nb_moved));
+          }, is_splittable_fn);
+          s = plus::add_nb_iters(s, -nb_moved);
+          if (! rcell.ready.empty()) {
+            // the top frame of each stack but the last is the parent of
+            // the bottom frame of the next one
+            stolen_from(s, rcell.ready[0]);
+            for (size_t i = 0; i + 1 < rcell.ready.size(); i++) {
+              stolen_from(rcell.ready[i], rcell.ready[i + 1]);
+            }
+            t = rcell.ready.back();
+            rcell.ready.pop_back();
+            stats.nb_steals++;
+          }
+        }
+      }
+      if (plus::empty(t)) {
+        stats.nb_rejected++;
+      }
+      rcell.s = t;
+      rcell.status.store(Response_ready, std::memory_order_release);
+      cell.request.store(no_request, std::memory_order_relaxed);
+    }
+
+    void worker::reject_requests() {
+      auto& cell = rt.cells[id];
+      int r = cell.request.exchange(blocked, std::memory_order_acquire);
+      if (r >= 0) {
+        auto& rcell = rt.cells[r];
+        rcell.s = plus::create_stack();
+        rcell.status.store(Response_ready, std::memory_order_release);
+      }
+    }
+
+    void worker::steal() {
+      auto& cell = rt.cells[id];
+      while (! rt.done.load(std::memory_order_relaxed)) {
+        reject_requests();
+        reap_io();
+        if (! ready.empty()) {
+          // open the cell again, as after a successful steal
+          cell.request.store(no_request, std::memory_order_release);
+          return;
+        }
+        if (rt.config.nb_workers == 1) {
+          std::this_thread::yield();
+          continue;
+        }
+        int v = (rt.config.victim_selection == Victim_richest) ? richest_victim() : sel.random_victim();
+        int nr = no_request;
+        cell.status.store(Response_waiting, std::memory_order_relaxed);
+        if (! rt.cells[v].request.compare_exchange_strong(nr, id)) {
+          steal_failed();
+          std::this_thread::yield();
+          continue;
+        }
+        while (cell.status.load(std::memory_order_acquire) == Response_waiting) {
+          reject_requests();
+          if (rt.done.load(std::memory_order_relaxed)) {
+            return;
+          }
+          std::this_thread::yield();
+        }
+        if (! plus::empty(cell.s)) {
+          s = cell.s;
+          ready.insert(ready.end(), cell.ready.begin(), cell.ready.end());
+          cell.ready.clear();
+          cell.request.store(no_request, std::memory_order_release);
+          stats.nb_steals_at_level[sel.succeeded()]++;
+          nb_idle_attempts = 0;
+          return;
+        }
+        steal_failed();
+      }
+    }
+
+    void worker::run() {
+      auto& cell = rt.cells[id];
+      cell.request.store(no_request, std::memory_order_release);
+      while (! rt.done.load(std::memory_order_relaxed)) {
+        if (plus::empty(s) && ready.empty()) {
+          reap_io();
+        }
+        if (plus::empty(s) && ! ready.empty()) {
+          s = ready.back();
+          ready.pop_back();
+        }
+        if (plus::empty(s)) {
+          publish_parallelism();
+          steal();
+          continue;
+        }
+        if (++nb_steps >= rt.config.polling_interval) {
+          nb_steps = 0;
+          reap_io();
+          poll();
+          publish_parallelism();
+        }
+        top()->run(*this);
+      }
+      reject_requests();
+    }
+
+    // binds the calling thread to the cpu i modulo the number of cpus
+    static inline
+    void pin_to_cpu(int i) {
+#ifdef __linux__
+      int nb_cpus = std::max(1, (int)std::thread::hardware_concurrency());
+      cpu_set_t mask;
+      CPU_ZERO(&mask);
+      CPU_SET(i % nb_cpus, &mask);
+      pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+#endif
+    }
+
+    /* Runs the computation rooted at a frame of type T, built from
+     * args, on config.nb_workers workers, the calling thread being
+     * one of them. Returns the statistics of all workers combined.
+     */
+    template <class T, class ... Args>
+    stats_type launch(config_type config, Args&& ... args) {
+      assert(config.nb_workers >= 1);
+      assert(config.polling_interval >= 1);
+      runtime_state rt(config);
+      std::vector<worker> workers;
+      workers.reserve(config.nb_workers);
+      for (int i = 0; i < config.nb_workers; i++) {
+        workers.emplace_back(i, rt);
+      }
+      cpu_topology topo;
+      if (config.victim_selection == Victim_hierarchical) {
+        topo = read_cpu_topology(config.topology_root);
+      }
+      for (int i = 0; i < config.nb_workers; i++) {
+        add_victims(workers[i].victims(), i, config.nb_workers, topo);
+      }
+      auto t = create_stack<T>(nullptr, std::forward<Args>(args)...);
+      workers[0].adopt(update_reported_iters(t, plus::frame_data<frame>(t.fp)));
+      std::vector<std::thread> threads;
+      for (int i = 1; i < config.nb_workers; i++) {
+        threads.emplace_back([&, i] {
+          if (config.pin_workers) {
+            pin_to_cpu(i);
+          }
+          workers[i].run();
+        });
+      }
+#ifdef __linux__
+      cpu_set_t mask;
+      sched_getaffinity(0, sizeof(mask), &mask);
+#endif
+      if (config.pin_workers) {
+        pin_to_cpu(0);
+      }
+      workers[0].run();
+#ifdef __linux__
+      if (config.pin_workers) {
+        sched_setaffinity(0, sizeof(mask), &mask);
+      }
+#endif
+      for (auto& t : threads) {
+        t.join();
+      }
+      stats_type r = { 0, 0, 0, { 0 }, 0 };
+      for (auto& w : workers) {
+        r.nb_steals += w.stats.nb_steals;
+        r.nb_splits += w.stats.nb_splits;
+        r.nb_rejected += w.stats.nb_rejected;
+        for (int l = 0; l < nb_topology_levels; l++) {
+          r.nb_steals_at_level[l] += w.stats.nb_steals_at_level[l];
+        }
+        r.nb_parks += w.stats.nb_parks;
+      }
+      return r;
+    }
+
+    /* Runtime */
+    /*------------------------------*/
+
+    /*------------------------------*/
+    /* Parallel loop */
+
+    /* A frame running the iterations [lo, hi) of a loop, with the
+     * body given by the method body(i) of Derived, grain iterations
+     * per scheduling step. A steal request may split off the upper
+     * half of the remaining iterations.
+     */
+    template <class Derived>
+    class loop_frame : public frame {
+    public:
+
+      size_t lo, hi, grain;
+
+      bool synced = false;
+
+      loop_frame(size_t lo, size_t hi, size_t grain = 1)
+        : lo(lo), hi(hi), grain(grain) { }
+
+      bool splittable() override {
+        return hi - lo >= 2;
+      }
+
+      long nb_iters() override {
+        return (long)(hi - lo);
+      }
+
+      plus::stack_type split() override {
+        size_t mid = lo + (hi - lo) / 2;
+        Derived& d = *(Derived*)this;
+        auto t = create_stack<Derived>(this, d);
+        Derived& d2 = *plus::frame_data<Derived>(t.fp);
+        d2.lo = mid;
+        d2.synced = false;
+        hi = mid;
+        // the copy was pushed with the whole range
+        return plus::set_splittable(t, t.fp, d2.splittable(), is_splittable_fn);
+      }
+
+      void run(worker& w) override {
+        if (lo < hi) {
+          size_t n = std::min(grain, hi - lo);
+          for (size_t i = 0; i < n; i++) {
+            ((Derived*)this)->body(lo++);
+          }
+          if (! splittable()) {
+            w.set_splittable(this, false);
+          }
+          w.report_iters(this);
+          return;
+        }
+        if (! synced) {
+          synced = true;
+          w.sync();
+          return;
+        }
+        ((Derived*)this)->done();
+        w.finish();
+      }
+
+      // called once all iterations, including those split off, are done
+      void done() { }
+
+    };
+
+    /* A parallel loop that reduces the values produced by its
+     * iterations. The body of Derived adds to acc, which is private
+     * to each piece of the loop. A piece split off a frame is linked
+     * into the list of pieces of that frame and, once finished,
+     * stays in place with its acc, as the frame of a future does:
+     * its chunk holds an extra reference until the frame reads it.
+     * A frame combines the acc of its pieces after it syncs with
+     * them, in the order of the iterations, and then releases them,
+     * so that splitting allocates nothing beyond the stack of the
+     * piece and no atomic operation touches acc. The result of the
+     * whole loop goes to dst.
+     */
+    template <class Derived, class T, class Combine = std::plus<T>>
+    class reduce_frame : public loop_frame<Derived> {
+    public:
+
+      T identity;
+
+      T acc;
+
+      T* dst;
+
+      // pieces split off, the most recent first
+      Derived* pieces = nullptr;
+
+      // next piece split off the same frame
+      Derived* next_piece = nullptr;
+
+      reduce_frame(size_t lo, size_t hi, T identity, T* dst, size_t grain = 1)
+        : loop_frame<Derived>(lo, hi, grain), identity(identity), acc(identity), dst(dst) { }
+
+      // a piece starts from the identity, with no pieces of its own
+      reduce_frame(const reduce_frame& other)
+        : loop_frame<Derived>(other), identity(other.identity),
+          acc(other.identity), dst(nullptr) { }
+
+      plus::stack_type split() override {
+        auto t = loop_frame<Derived>::split();
+        Derived* d = plus::frame_data<Derived>(t.fp);
+        d->kept = true;
+        plus::incr_refcount(plus::chunk_of(t.fp));
+        d->next_piece = pieces;
+        pieces = d;
+        return t;
+      }
+
+      void done() {
+        Combine combine;
+        // each piece holds the iterations just above the previous one
+        while (pieces != nullptr) {
+          Derived* d = pieces;
+          pieces = d->next_piece;
+          acc = combine(acc, d->acc);
+          d->~Derived();
+          plus::decr_refcount(plus::chunk_of(plus::frame_header_of((char*)d)));
+        }
+        if (dst != nullptr) {
+          *dst = acc;
+        }
+      }
+
+    };
+
+    /* A frame running a loop over the N-dimensional box [lo, hi),
+     * cut into tiles of tile[d] indices along each dimension d,
+     * counted from lo. The body of Derived is called on one tile at a
+     * time, as body(tlo, thi). A steal request splits off the upper
+     * half of the remaining box along the dimension that has the most
+     * tiles left, at a tile boundary, so that each piece keeps whole
+     * tiles. The frame takes off the box the slab of tiles at the
+     * lower end of that same dimension, which leaves a box behind,
+     * and then runs one tile of the slab per scheduling step, so
+     * that the worker polls for steal requests between tiles. Only
+     * the box is split, never the slab in progress.
+     */
+    template <class Derived, int N>
+    class blocked_loop_frame : public frame {
+    public:
+
+      using index_type = std::array<size_t, N>;
+
+      index_type lo, hi, tile;
+
+      // slab [slo, shi) in progress, if any, and its next tile, at tlo
+      index_type slo, shi, tlo;
+
+      bool in_slab = false;
+
+      bool synced = false;
+
+      blocked_loop_frame(index_type lo, index_type hi, index_type tile)
+        : lo(lo), hi(hi), tile(tile) { }
+
+      size_t nb_tiles(int d) const {
+        return (hi[d] - lo[d] + tile[d] - 1) / tile[d];
+      }
+
+      size_t nb_tiles() const {
+        size_t n = 1;
+        for (int d = 0; d < N; d++) {
+          n *= nb_tiles(d);
+        }
+        return n;
+      }
+
+      int longest_dimension() const {
+        int r = 0;
+        for (int d = 1; d < N; d++) {
+          if (nb_tiles(d) > nb_tiles(r)) {
+            r = d;
+          }
+        }
+        return r;
+      }
+
+      bool splittable() override {
+        return nb_tiles() >= 2;
+      }
+
+      long nb_iters() override {
+        return (long)nb_tiles();
+      }
+
+      plus::stack_type split() override {
+        int d = longest_dimension();
+        size_t mid = lo[d] + (nb_tiles(d) / 2) * tile[d];
+        Derived& x = *(Derived*)this;
+        auto t = create_stack<Derived>(this, x);
+        Derived& x2 = *plus::frame_data<Derived>(t.fp);
+        x2.lo[d] = mid;
+        x2.in_slab = false;
+        x2.synced = false;
+        hi[d] = mid;
+        // the copy was pushed with the whole box
+        return plus::set_splittable(t, t.fp, x2.splittable(), is_splittable_fn);
+      }
+
+      void run(worker& w) override {
+        if ((! in_slab) && (nb_tiles() > 0)) {
+          int d = longest_dimension();
+          slo = lo;
+          shi = hi;
+          shi[d] = std::min(lo[d] + tile[d], hi[d]);
+          tlo = slo;
+          lo[d] = shi[d];
+          in_slab = true;
+        }
+        if (in_slab) {
+          index_type thi;
+          for (int e = 0; e < N; e++) {
+            thi[e] = std::min(tlo[e] + tile[e], shi[e]);
+          }
+          ((Derived*)this)->body(tlo, thi);
+          // moves on to the next tile of the slab, in row-major order
+          int e = N - 1;
+          while ((e >= 0) && (thi[e] >= shi[e])) {
+            tlo[e] = slo[e];
+            e--;
+          }
+          if (e < 0) {
+            in_slab = false;
+          } else {
+            tlo[e] = thi[e];
+          }
+          if (! splittable()) {
+            w.set_splittable(this, false);
+          }
+          w.report_iters(this);
+          return;
+        }
+        if (! synced) {
+          synced = true;
+          w.sync();
+          return;
+        }
+        ((Derived*)this)->done();
+        w.finish();
+      }
+
+      void done() { }
+
+    };
+
+    /* Parallel loop */
+    /*------------------------------*/
+
+  } // end namespace
+} // end namespace
+
+#endif /*! _CACTUS_STACK_RUNTIME_H_ */
@@ -114,7 +114,8 @@ namespace cactus_stack {
     
     using trace_tag_type = enum {
       Trace_push_back, Trace_pop_back,
-      Trace_fork_mark,
+      Trace_fork_mark, Trace_destroy_stack,
+      Trace_pop_until, Trace_replace_back,
       Trace_nil
     };
     
@@ -131,6 +132,19 @@ namespace cactus_stack {
         std::shared_ptr<struct trace_struct> k1;
         std::shared_ptr<struct trace_struct> k2;
       } fork_mark;
+      struct {
+        bool trivial = false;
+      } destroy_stack;
+      struct {
+        size_t nb = 0;
+        bool trivial = false;
+        std::shared_ptr<struct trace_struct> k;
+      } pop_until;
+      struct {
+        frame f;
+        bool big = false;
+        std::shared_ptr<struct trace_struct> k;
+      } replace_back;
     };
     
     using trace_type = struct trace_struct;
@@ -154,6 +168,29 @@ namespace cactus_stack {
       return std::make_shared<trace_type>(t);
     }
     
+    std::shared_ptr<trace_type> mk_destroy_stack(bool trivial) {
+      trace_type t;
+      t.tag = Trace_destroy_stack;
+      t.destroy_stack.trivial = trivial;
+      return std::make_shared<trace_type>(t);
+    }
+    
+    std::shared_ptr<trace_type> mk_pop_until(size_t nb, bool trivial) {
+      trace_type t;
+      t.tag = Trace_pop_until;
+      t.pop_until.nb = nb;
+      t.pop_until.trivial = trivial;
+      return std::make_shared<trace_type>(t);
+    }
+    
+    std::shared_ptr<trace_type> mk_replace_back(frame f, bool big) {
+      trace_type t;
+      t.tag = Trace_replace_back;
+      t.replace_back.f = f;
+      t.replace_back.big = big;
+      return std::make_shared<trace_type>(t);
+    }
+    
     void print_trace(std::ostream& out, std::shared_ptr<trace_type> t, const std::string& prefix, bool is_tail) {
       out << (prefix + (is_tail ? "└── " : "├── "));
       switch (t->tag) {
@@ -183,6 +220,26 @@ namespace cactus_stack {
           }
           break;
         }
+        case Trace_destroy_stack: {
+          out << "x" << (t->destroy_stack.trivial ? "[]" : "[~]") << std::endl;
+          break;
+        }
+        case Trace_pop_until: {
+          out << "-" << t->pop_until.nb << (t->pop_until.trivial ? "[]" : "[~]") << std::endl;
+          if (t->pop_until.k) {
+            print_trace(out, t->pop_until.k, prefix + (is_tail ? "    " : "│   "), true);
+          }
+          break;
+        }
+        case Trace_replace_back: {
+          auto plt = t->replace_back.f.plt;
+          auto plt_s = (plt == Parent_link_async ? "A" : "S");
+          out << "=[" << t->replace_back.f.v << "](" << plt_s << ")" << std::endl;
+          if (t->replace_back.k) {
+            print_trace(out, t->replace_back.k, prefix + (is_tail ? "    " : "│   "), true);
+          }
+          break;
+        }
         case Trace_nil: {
           break;
         }
@@ -220,6 +277,20 @@ namespace cactus_stack {
         std::deque<frame> prefix2(prefix.begin() + posn, prefix.end());
         r->fork_mark.k1 = gen_random_trace(prefix1, d + 1);
         r->fork_mark.k2 = gen_random_trace(prefix2, d + 1);
+      } else if (quickcheck::generateInRange(0, 15) == 0) {
+        r = mk_destroy_stack(flip_coin());
+      } else if (quickcheck::generateInRange(0, 7) == 0) {
+        size_t nb = quickcheck::generateInRange(1, (int)n_p);
+        std::deque<frame> prefix2(prefix.begin(), prefix.end() - nb);
+        r = mk_pop_until(nb, flip_coin());
+        r->pop_until.k = gen_random_trace(prefix2, d);
+      } else if (quickcheck::generateInRange(0, 7) == 0) {
+        auto f = gen_random_frame();
+        std::deque<frame> prefix2(prefix);
+        prefix2.pop_back();
+        prefix2.push_back(f);
+        r = mk_replace_back(f, flip_coin());
+        r->replace_back.k = gen_random_trace(prefix2, d);
       } else if (quickcheck::generateInRange(0, (2 + (1 << n_p)) - 1) < 3) {
         auto f = gen_random_frame();
         std::deque<frame> prefix2(prefix);
@@ -427,6 +498,58 @@ namespace cactus_stack {
               tc_n.t = tc_m.t->pop_back.k;
               break;
             }
+            case Trace_destroy_stack: {
+              n.tag = Machine_thread;
+              if (tc_m.t->destroy_stack.trivial) {
+                destroy_stack(tc_m.ms);
+              } else {
+                destroy_stack(tc_m.ms, [&] (char* p) {
+                  ((frame*)(p))->~frame();
+                });
+              }
+              tc_n.ms = create_stack();
+              tc_n.t = nullptr;
+              break;
+            }
+            case Trace_pop_until: {
+              n.tag = Machine_thread;
+              size_t nb = tc_m.t->pop_until.nb;
+              tc_n.rs = tc_m.rs;
+              frame_header_type* target = tc_m.ms.fp;
+              for (size_t i = 0; i < nb; i++) {
+                tc_n.rs.pop_back();
+                target = target->pred;
+              }
+              if (tc_m.t->pop_until.trivial) {
+                tc_n.ms = pop_until(tc_m.ms, target);
+              } else {
+                tc_n.ms = pop_until(tc_m.ms, target, [&] (char* p) {
+                  ((frame*)(p))->~frame();
+                });
+              }
+              tc_n.t = tc_m.t->pop_until.k;
+              break;
+            }
+            case Trace_replace_back: {
+              frame f = tc_m.t->replace_back.f;
+              n.tag = Machine_thread;
+              tc_n.rs = tc_m.rs;
+              tc_n.rs.pop_back();
+              tc_n.rs.push_back(f);
+              auto destruct_fn = [&] (char* p) {
+                ((frame*)(p))->~frame();
+              };
+              auto initialize_fn = [&] (char* p) {
+                new ((frame*)p) frame(f);
+              };
+              if (tc_m.t->replace_back.big) {
+                tc_n.ms = replace_back<2 * sizeof(frame)>(tc_m.ms, f.plt, destruct_fn, initialize_fn);
+              } else {
+                tc_n.ms = replace_back<sizeof(frame)>(tc_m.ms, f.plt, destruct_fn, initialize_fn);
+              }
+              tc_n.t = tc_m.t->replace_back.k;
+              break;
+            }
             default: {
               assert(false);
             }
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "cactus-checkpoint.hpp"
+
+namespace cactus_stack {
+  namespace plus {
+
+    namespace {
+
+      auto is_splittable_fn = [] (char*) {
+        return false;
+      };
+
+      auto destruct_fn = [] (char*, shared_frame_type) { };
+
+      class node {
+      public:
+
+        long value;
+
+        // data of the frame below, or nullptr for the root
+        node* parent;
+
+        // an object off the stack, which restoring leaves as is
+        long* heap;
+
+      };
+
+      // frames of a few sizes, such that pushes often take new chunks
+      const size_t frame_szbs[] = { sizeof(node), 512, 1024 };
+
+      long heap_object = 42;
+
+      stack_type push_node(stack_type s, size_t nb, parent_link_type ty, long v) {
+        node* parent = empty(s) ? nullptr : frame_data<node>(s.fp);
+        return push_back(s, nb, ty, [&] (char* p) {
+          new (p) node { v, parent, &heap_object };
+        }, is_splittable_fn);
+      }
+
+      // fixes the pointer that each node holds to the one below
+      auto relocate_fn = [] (char* p, const relocation_type& r) {
+        node* n = (node*)p;
+        n->parent = r(n->parent);
+        n->heap = r(n->heap);
+      };
+
+      std::vector<chunk_type*> chunks_of_stack(stack_type s) {
+        std::vector<chunk_type*> cs;
+        for (frame_header_type* fp = s.fp; fp != nullptr; fp = fp->pred) {
+          cs.push_back(chunk_of(fp));
+        }
+        return cs;
+      }
+
+      int nb_frames(stack_type s) {
+        int n = 0;
+        for (frame_header_type* fp = s.fp; fp != nullptr; fp = fp->pred) {
+          n++;
+        }
+        return n;
+      }
+
+      int pop_all(stack_type s) {
+        int n = 0;
+        while (! empty(s)) {
+          s = pop_back(s, destruct_fn);
+          n++;
+        }
+        return n;
+      }
+
+      /* Checks that t, restored from a checkpoint of s, holds the same
+       * frames, with the same links and marks, in chunks of its own.
+       */
+      void check_same(stack_type s, stack_type t) {
+        auto cs = chunks_of_stack(s);
+        frame_header_type* fp = s.fp;
+        frame_header_type* ft = t.fp;
+        while (fp != nullptr) {
+          assert(ft != nullptr);
+          assert(std::find(cs.begin(), cs.end(), chunk_of(ft)) == cs.end());
+          node* np = frame_data<node>(fp);
+          node* nt = frame_data<node>(ft);
+          assert(nt->value == np->value);
+          assert(nt->heap == &heap_object);
+          assert(ft->ext.clt == fp->ext.clt);
+          // the bottom frame is restored with no predecessor
+          if (ft->pred != nullptr) {
+            assert(nt->parent == frame_data<node>(ft->pred));
+          }
+          fp = fp->pred;
+          ft = ft->pred;
+        }
+        assert(ft == nullptr);
+        frame_header_type* mp = s.mhd;
+        frame_header_type* mt = t.mhd;
+        frame_header_type* prev = nullptr;
+        while (mp != nullptr) {
+          assert(mt != nullptr);
+          assert(mt->ext.pred == prev);
+          assert(frame_data<node>(mt)->value == frame_data<node>(mp)->value);
+          prev = mt;
+          mp = mp->ext.succ;
+          mt = mt->ext.succ;
+        }
+        assert(mt == nullptr);
+        assert(t.mtl == prev);
+        assert(t.par.nb_marks == s.par.nb_marks);
+        assert(t.par.nb_iters == s.par.nb_iters);
+      }
+
+      /* Saves and restores s, checks the copy, then uses it as any
+       * other stack: pushes and pops a frame, forks off its marks, and
+       * pops all of the pieces.
+       */
+      void check_round_trip(stack_type s, const char* path) {
+        bool ok = serialize(s, path);
+        assert(ok);
+        auto r = restore(path, relocate_fn);
+        assert(r.first);
+        stack_type t = r.second;
+        check_same(s, t);
+        int n = nb_frames(t);
+        t = push_node(t, sizeof(node), Parent_link_sync, -1);
+        assert(frame_data<node>(t.fp)->parent == frame_data<node>(t.fp->pred));
+        t = pop_back(t, destruct_fn);
+        std::vector<stack_type> pieces;
+        t = fork_marks(t, t.par.nb_marks, [&] (stack_type u) {
+          pieces.push_back(u);
+        }, is_splittable_fn);
+        assert(t.par.nb_marks == 0);
+        int m = 0;
+        for (auto it = pieces.rbegin(); it != pieces.rend(); it++) {
+          m += pop_all(*it);
+        }
+        m += pop_all(t);
+        assert(m == n);
+        (void)ok;
+      }
+
+    } // end namespace
+
+    /* Builds a stack with sync and async frames, forks it in three by
+     * fork_marks, and checkpoints each of the three pieces, which have
+     * marks, and chunks in common with one another. With join
+     * counters, the pieces wait on, or count in, one another, and
+     * cannot be saved until the ones forked off are popped.
+     */
+    void check_forked(std::mt19937& rng, const char* path) {
+      stack_type s = create_stack();
+      int n = std::uniform_int_distribution<int>(20, 60)(rng);
+      for (int i = 0; i < n; i++) {
+        bool async = (i > 0) && (std::uniform_int_distribution<int>(0, 2)(rng) == 0);
+        size_t nb = frame_szbs[std::uniform_int_distribution<int>(0, 2)(rng)];
+        s = push_node(s, nb, async ? Parent_link_async : Parent_link_sync, i);
+      }
+      std::vector<stack_type> pieces;
+      if (s.par.nb_marks > 0) {
+        s = fork_marks(s, 2, [&] (stack_type u) {
+          pieces.push_back(u);
+        }, is_splittable_fn);
+      }
+      pieces.insert(pieces.begin(), s);
+      int m = 0;
+      bool joined = join_counter && (pieces.size() > 1);
+      for (auto& p : pieces) {
+        if (joined) {
+          bool ok = serialize(p, path);
+          assert(! ok);
+          (void)ok;
+        } else {
+          check_round_trip(p, path);
+        }
+        m += nb_frames(p);
+      }
+      assert(m == n);
+      for (auto it = pieces.rbegin(); it != pieces.rend(); it++) {
+        // the pieces forked off are popped by the time s comes
+        if (joined && (&*it == &pieces.front())) {
+          check_round_trip(*it, path);
+        }
+        pop_all(*it);
+      }
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  char path[] = "/tmp/cactus-checkpoint-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  std::mt19937 rng(42);
+  for (int i = 0; i < 200; i++) {
+    cactus_stack::plus::check_forked(rng, path);
+  }
+  unlink(path);
+  std::cout << "OK, checkpoint" << std::endl;
+  return 0;
+}
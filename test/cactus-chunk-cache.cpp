@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <thread>
+#include <set>
+#include <vector>
+#include <assert.h>
+
+#include "cactus-plus.hpp"
+
+namespace cactus_stack {
+  namespace plus {
+
+    namespace {
+
+      auto is_splittable_fn = [] (char*) {
+        return false;
+      };
+
+      auto destruct_fn = [] (char*, shared_frame_type) { };
+
+      // frames large enough that each takes a chunk of its own
+      static constexpr
+      int big_frame_szb = (K - sizeof(chunk_header_type)) / 2 + 8;
+
+      stack_type push_chunks(stack_type s, int nb) {
+        for (int i = 0; i < nb; i++) {
+          s = push_back<big_frame_szb>(s, Parent_link_sync, [] (char*) { }, is_splittable_fn);
+        }
+        return s;
+      }
+
+      std::set<chunk_type*> chunks_of(stack_type s) {
+        std::set<chunk_type*> cs;
+        for (auto fp = s.fp; fp != nullptr; fp = fp->pred) {
+          cs.insert(chunk_of(fp));
+        }
+        return cs;
+      }
+
+    } // end namespace
+
+    // thread B releases chunks that thread A created, and A reuses them
+    void check_remote_release() {
+      static constexpr
+      int nb = 16;
+      stack_type s = create_stack();
+      s = push_chunks(s, nb);
+      std::set<chunk_type*> cs = chunks_of(s);
+      assert((int)cs.size() == nb);
+      chunk_cache_type* cache = my_chunk_cache();
+      for (auto c : cs) {
+        assert(c->hdr.owner == cache);
+      }
+      std::thread b([&] {
+        destroy_stack(s, destruct_fn);
+      });
+      b.join();
+      assert(cache->remote.load() != nullptr);
+      std::vector<chunk_type*> reused;
+      for (int i = 0; i < nb; i++) {
+        reused.push_back(create_chunk(nullptr, nullptr));
+      }
+      for (auto c : reused) {
+        assert(cs.count(c) == 1);
+        assert(c->hdr.owner == cache);
+      }
+      assert(cache->remote.load() == nullptr);
+      for (auto c : reused) {
+        release_chunk(c);
+      }
+    }
+
+    // chunks that the owner releases are kept for its next create_chunk
+    void check_local_release() {
+      stack_type s = create_stack();
+      s = push_chunks(s, 4);
+      std::set<chunk_type*> cs = chunks_of(s);
+      destroy_stack(s, destruct_fn);
+      s = push_chunks(create_stack(), 4);
+      assert(chunks_of(s) == cs);
+      destroy_stack(s, destruct_fn);
+    }
+
+    // chunks released after their owner exits are freed directly
+    void check_release_after_exit() {
+      stack_type s = create_stack();
+      std::thread a([&] {
+        s = push_chunks(s, 4);
+      });
+      a.join();
+      destroy_stack(s, destruct_fn);
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::plus::check_remote_release();
+  cactus_stack::plus::check_local_release();
+  cactus_stack::plus::check_release_after_exit();
+  std::cout << "OK, chunk cache" << std::endl;
+  return 0;
+}
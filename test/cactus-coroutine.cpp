@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <assert.h>
+
+#include "cactus-plus.hpp"
+
+/* GCC 12 pairs operator new and operator delete by their mangled
+ * names, and a template operator new, such as the one of
+ * coroutine_promise, never matches the usual operator delete, which
+ * is the one that coroutines must free their frames with. Without
+ * optimization, it then flags the delete on the exception path of
+ * each coroutine that allocates through the promise.
+ */
+#if defined(__GNUC__) && ! defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+namespace cactus_stack {
+  namespace plus {
+
+    namespace {
+
+      /* A lazy coroutine that its caller awaits, and that resumes
+       * the caller when it is done.
+       */
+      template <class T, class Promise = coroutine_promise>
+      class task {
+      public:
+
+        class promise_type : public Promise {
+        public:
+
+          T value = T();
+
+          std::coroutine_handle<> continuation;
+
+          task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+          }
+
+          std::suspend_always initial_suspend() noexcept {
+            return { };
+          }
+
+          class final_awaiter {
+          public:
+
+            bool await_ready() noexcept {
+              return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+              auto c = h.promise().continuation;
+              return c ? c : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept { }
+
+          };
+
+          final_awaiter final_suspend() noexcept {
+            return { };
+          }
+
+          void return_value(T v) {
+            value = v;
+          }
+
+          void unhandled_exception() {
+            std::terminate();
+          }
+
+        };
+
+        std::coroutine_handle<promise_type> h;
+
+        explicit task(std::coroutine_handle<promise_type> h)
+          : h(h) { }
+
+        task(task&& other)
+          : h(std::exchange(other.h, { })) { }
+
+        ~task() {
+          if (h) {
+            h.destroy();
+          }
+        }
+
+        bool await_ready() {
+          return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) {
+          h.promise().continuation = c;
+          return h;
+        }
+
+        T await_resume() {
+          return h.promise().value;
+        }
+
+        // runs the coroutine from outside of any coroutine
+        T run() {
+          h.resume();
+          assert(h.done());
+          return h.promise().value;
+        }
+
+      };
+
+      long fib_seq(int n) {
+        return (n < 2) ? n : fib_seq(n - 1) + fib_seq(n - 2);
+      }
+
+      task<long> fib(coroutine_stack& cs, int n) {
+        if (n < 2) {
+          co_return n;
+        }
+        // the frame of this coroutine is on cs, below the ones of its callees
+        assert(! empty(cs.s));
+        long a = co_await fib(cs, n - 1);
+        long b = co_await fib(cs, n - 2);
+        co_return a + b;
+      }
+
+      task<int> leaf(coroutine_stack&, int v) {
+        co_return v;
+      }
+
+      task<int, spawned_coroutine_promise> spawned_leaf(coroutine_stack&, int v) {
+        co_return v;
+      }
+
+      // awaits a callee created on the stack that callees points to
+      task<int, spawned_coroutine_promise> spawned_add(coroutine_stack&, coroutine_stack*& callees, int v) {
+        int x = co_await leaf(*callees, v);
+        co_return x + 1;
+      }
+
+      task<int> big(coroutine_stack&, int v) {
+        volatile char buf[2 * K];
+        buf[0] = (char)v;
+        co_await std::suspend_never();
+        co_return buf[0];
+      }
+
+    } // end namespace
+
+    void check_fib() {
+      coroutine_stack cs;
+      {
+        task<long> t = fib(cs, 15);
+        assert(! empty(cs.s));
+        assert(t.run() == fib_seq(15));
+      }
+      assert(empty(cs.s));
+    }
+
+    // frames destroyed out of order are popped once the frames above are
+    void check_out_of_order() {
+      coroutine_stack cs;
+      task<int>* t1 = new task<int>(leaf(cs, 1));
+      task<int>* t2 = new task<int>(leaf(cs, 2));
+      frame_header_type* fp2 = cs.s.fp;
+      delete t1;
+      assert(cs.s.fp == fp2);
+      assert(t2->run() == 2);
+      delete t2;
+      assert(empty(cs.s));
+    }
+
+    /* The frame of a spawned coroutine, forked off, is popped from
+     * the stack it went to, and the stack that it was forked from
+     * pushes on a chunk of its own until the join.
+     */
+    void check_fork() {
+      coroutine_stack cs;
+      coroutine_stack ts;
+      task<int> a = leaf(cs, 1);
+      frame_header_type* fpa = cs.s.fp;
+      // nothing was spawned
+      assert(! cs.fork(ts));
+      coroutine_stack* callees = &cs;
+      auto b = spawned_add(cs, callees, 2);
+      frame_header_type* fpb = cs.s.fp;
+      assert(cs.s.mtl == fpb);
+      auto e = spawned_leaf(cs, 3);
+      assert(cs.fork(ts));
+      assert(cs.s.fp == fpa);
+      assert(empty_mark(cs.s));
+      assert(ts.s.fp != fpb);
+      assert(ts.s.fp->pred == fpb);
+      {
+        task<int> c = leaf(cs, 4);
+        assert(chunk_of(cs.s.fp) != chunk_of(fpa));
+        assert(c.run() == 4);
+      }
+      assert(cs.s.fp == fpa);
+      // b runs on ts, and so do its callees
+      callees = &ts;
+      assert(b.run() == 3);
+      b.h.destroy();
+      b.h = nullptr;
+      // e, above b, keeps both on ts
+      assert(! empty(ts.s));
+      assert(e.run() == 3);
+      e.h.destroy();
+      e.h = nullptr;
+      assert(empty(ts.s));
+      cs.join(ts);
+      {
+        // the chunk of a is no longer shared
+        task<int> d = leaf(cs, 5);
+        assert(chunk_of(cs.s.fp) == chunk_of(fpa));
+        assert(d.run() == 5);
+      }
+      assert(a.run() == 1);
+    }
+
+    // a spawned coroutine with no frame below it stays in place
+    void check_fork_bottom() {
+      coroutine_stack cs;
+      coroutine_stack ts;
+      {
+        auto b = spawned_leaf(cs, 1);
+        assert(! cs.fork(ts));
+        assert(b.run() == 1);
+      }
+      assert(empty(cs.s));
+    }
+
+    // frames that do not fit in a chunk come from the heap
+    void check_big() {
+      coroutine_stack cs;
+      {
+        task<int> t = big(cs, 7);
+        assert(empty(cs.s));
+        assert(t.run() == 7);
+      }
+      assert(empty(cs.s));
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::plus::check_fib();
+  cactus_stack::plus::check_out_of_order();
+  cactus_stack::plus::check_fork();
+  cactus_stack::plus::check_fork_bottom();
+  cactus_stack::plus::check_big();
+  std::cout << "OK, coroutine_stack" << std::endl;
+  return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <assert.h>
+
+#include "cactus-fiber.hpp"
+
+namespace cactus_stack {
+  namespace fiber {
+
+    namespace {
+
+      std::vector<int> trace;
+
+      int nb_destructed = 0;
+
+      // records id, then yields, nb times in a row
+      class yielder : public frame {
+      public:
+
+        int id;
+
+        int nb;
+
+        yielder(int id, int nb) : id(id), nb(nb) { }
+
+        void run(scheduler& sc) override {
+          if (nb == 0) {
+            sc.finish();
+            return;
+          }
+          trace.push_back(id);
+          nb--;
+          sc.yield();
+        }
+
+      };
+
+      /* Calls a child that suspends the fiber, saving the fiber in
+       * *dst, then records id once the fiber is resumed.
+       */
+      class sleeper : public frame {
+      public:
+
+        class child : public frame {
+        public:
+
+          fiber** dst;
+
+          bool suspended = false;
+
+          child(fiber** dst) : dst(dst) { }
+
+          ~child() {
+            nb_destructed++;
+          }
+
+          void run(scheduler& sc) override {
+            if (! suspended) {
+              suspended = true;
+              *dst = sc.suspend();
+              return;
+            }
+            sc.finish();
+          }
+
+        };
+
+        int id;
+
+        fiber** dst;
+
+        bool called = false;
+
+        sleeper(int id, fiber** dst) : id(id), dst(dst) { }
+
+        ~sleeper() {
+          nb_destructed++;
+        }
+
+        void run(scheduler& sc) override {
+          if (! called) {
+            called = true;
+            sc.call<child>(dst);
+            return;
+          }
+          trace.push_back(id);
+          sc.finish();
+        }
+
+      };
+
+      // resumes, or destroys, the fiber in *f, then records id
+      class waker : public frame {
+      public:
+
+        int id;
+
+        fiber** f;
+
+        bool destroy;
+
+        waker(int id, fiber** f, bool destroy) : id(id), f(f), destroy(destroy) { }
+
+        void run(scheduler& sc) override {
+          assert((*f)->get_state() == Fiber_suspended);
+          if (destroy) {
+            sc.destroy(*f);
+          } else {
+            sc.resume(*f);
+          }
+          trace.push_back(id);
+          sc.finish();
+        }
+
+      };
+
+      // suspends, and resumes itself in the same step
+      class self_resumer : public frame {
+      public:
+
+        int step = 0;
+
+        void run(scheduler& sc) override {
+          if (step++ == 0) {
+            sc.resume(sc.suspend());
+            return;
+          }
+          trace.push_back(step);
+          sc.finish();
+        }
+
+      };
+
+    } // end namespace
+
+    void check_yield() {
+      trace.clear();
+      scheduler sc;
+      sc.spawn<yielder>(0, 3);
+      sc.spawn<yielder>(1, 3);
+      assert(sc.get_nb_fibers() == 2);
+      sc.run();
+      assert(sc.get_nb_fibers() == 0);
+      assert((trace == std::vector<int>{0, 1, 0, 1, 0, 1}));
+    }
+
+    void check_suspend_resume() {
+      trace.clear();
+      nb_destructed = 0;
+      scheduler sc;
+      fiber* f = nullptr;
+      sc.spawn<sleeper>(0, &f);
+      sc.spawn<waker>(1, &f, false);
+      sc.run();
+      assert((trace == std::vector<int>{1, 0}));
+      assert(nb_destructed == 2);
+      assert(sc.get_nb_fibers() == 0);
+      trace.clear();
+      sc.spawn<self_resumer>();
+      sc.run();
+      assert((trace == std::vector<int>{2}));
+      assert(sc.get_nb_fibers() == 0);
+    }
+
+    // destroys the middle one of three suspended fibers, then resumes the others
+    void check_destroy() {
+      trace.clear();
+      nb_destructed = 0;
+      scheduler sc;
+      fiber* fs[3] = { nullptr, nullptr, nullptr };
+      for (int i = 0; i < 3; i++) {
+        sc.spawn<sleeper>(i, &fs[i]);
+      }
+      sc.run();
+      assert(trace.empty());
+      assert(sc.get_nb_fibers() == 3);
+      sc.spawn<waker>(3, &fs[1], true);
+      sc.run();
+      assert(nb_destructed == 2);
+      assert(sc.get_nb_fibers() == 2);
+      sc.spawn<waker>(4, &fs[2], false);
+      sc.spawn<waker>(5, &fs[0], false);
+      sc.run();
+      assert((trace == std::vector<int>{3, 4, 5, 2, 0}));
+      assert(nb_destructed == 6);
+      assert(sc.get_nb_fibers() == 0);
+    }
+
+    // the destructor of the scheduler pops the frames of suspended fibers
+    void check_destructor() {
+      nb_destructed = 0;
+      {
+        scheduler sc;
+        fiber* fs[2];
+        sc.spawn<sleeper>(0, &fs[0]);
+        sc.spawn<sleeper>(1, &fs[1]);
+        sc.run();
+        assert(sc.get_nb_fibers() == 2);
+        sc.spawn<yielder>(2, 1);
+      }
+      assert(nb_destructed == 4);
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::fiber::check_yield();
+  cactus_stack::fiber::check_suspend_resume();
+  cactus_stack::fiber::check_destroy();
+  cactus_stack::fiber::check_destructor();
+  std::cout << "OK, fibers" << std::endl;
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory_resource>
+#include <assert.h>
+
+#include "cactus-plus.hpp"
+
+namespace cactus_stack {
+  namespace plus {
+
+    namespace {
+
+      auto is_splittable_fn = [] (char*) {
+        return false;
+      };
+
+      auto destruct_fn = [] (char*, shared_frame_type) { };
+
+      // counts the allocations that the stack could not serve
+      class counting_resource : public std::pmr::memory_resource {
+      public:
+
+        int nb_live = 0;
+
+        int nb_total = 0;
+
+      protected:
+
+        void* do_allocate(size_t nb, size_t align) override {
+          nb_live++;
+          nb_total++;
+          return std::pmr::new_delete_resource()->allocate(nb, align);
+        }
+
+        void do_deallocate(void* p, size_t nb, size_t align) override {
+          nb_live--;
+          std::pmr::new_delete_resource()->deallocate(p, nb, align);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+          return this == &other;
+        }
+
+      };
+
+      bool in_top_chunk(stack_type s, const void* p) {
+        return chunk_of((char*)p) == chunk_of(s.fp);
+      }
+
+    } // end namespace
+
+    void check_rollback() {
+      counting_resource up;
+      stack_type s = create_stack();
+      s = push_back<16>(s, Parent_link_sync, [] (char*) { }, is_splittable_fn);
+      frame_header_type* sp0 = s.sp;
+      {
+        frame_resource r(s, &up);
+        // the padding that aligns the allocation is rolled back too
+        void* p = r.allocate(24, 64);
+        assert(((uintptr_t)p % 64) == 0);
+        assert(in_top_chunk(s, p));
+        assert(s.sp != sp0);
+        r.deallocate(p, 24, 64);
+        assert(s.sp == sp0);
+        // only the most recent allocation is rolled back
+        void* p1 = r.allocate(8, 8);
+        void* p2 = r.allocate(8, 8);
+        frame_header_type* sp2 = s.sp;
+        r.deallocate(p1, 8, 8);
+        assert(s.sp == sp2);
+        r.deallocate(p2, 8, 8);
+        assert(s.sp != sp2);
+      }
+      assert(up.nb_total == 0);
+      s = pop_back(s, destruct_fn);
+      assert(empty(s));
+    }
+
+    void check_containers() {
+      counting_resource up;
+      stack_type s = create_stack();
+      s = push_back<16>(s, Parent_link_sync, [] (char*) { }, is_splittable_fn);
+      frame_header_type* sp0 = s.sp;
+      {
+        frame_resource r(s, &up);
+        std::pmr::vector<int> v(&r);
+        v.reserve(32);
+        assert(in_top_chunk(s, v.data()));
+        for (int i = 0; i < 32; i++) {
+          v.push_back(i);
+        }
+        std::pmr::string str("a string long enough to skip the small buffer", &r);
+        assert(in_top_chunk(s, str.data()));
+        // too large for a chunk, so served by upstream
+        std::pmr::vector<char> big(2 * K, 'x', &r);
+        assert(! in_top_chunk(s, big.data()));
+        assert(up.nb_live == 1);
+        for (int i = 0; i < 32; i++) {
+          assert(v[i] == i);
+        }
+      }
+      assert(up.nb_live == 0);
+      assert(s.sp >= sp0);
+      s = pop_back(s, destruct_fn);
+      assert(empty(s));
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::plus::check_rollback();
+  cactus_stack::plus::check_containers();
+  std::cout << "OK, frame_resource" << std::endl;
+  return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <atomic>
+#include <cstring>
+#include <assert.h>
+
+#include "cactus-runtime.hpp"
+
+namespace cactus_stack {
+  namespace runtime {
+
+    namespace {
+
+      long fib_seq(int n) {
+        return (n < 2) ? n : fib_seq(n - 1) + fib_seq(n - 2);
+      }
+
+      // computes fib(n) with a future for each of the two calls
+      class ffib : public future_frame<long> {
+      public:
+
+        int n;
+
+        future<long> f1, f2;
+
+        int state = 0;
+
+        ffib(int n) : n(n) { }
+
+        void run(worker& w) override {
+          switch (state) {
+            case 0: {
+              if (n < 2) {
+                result = n;
+                w.finish();
+                return;
+              }
+              state = 1;
+              f1 = w.spawn_future<ffib>(n - 1);
+              return;
+            }
+            case 1: {
+              state = 2;
+              f2 = w.spawn_future<ffib>(n - 2);
+              return;
+            }
+            case 2: {
+              state = 3;
+              w.await(f1);
+              return;
+            }
+            case 3: {
+              state = 4;
+              w.await(f2);
+              return;
+            }
+            case 4: {
+              result = f1.get() + f2.get();
+              w.finish();
+              return;
+            }
+          }
+        }
+
+      };
+
+      class fib_root : public frame {
+      public:
+
+        int n;
+
+        long* dst;
+
+        future<long> f;
+
+        int state = 0;
+
+        fib_root(int n, long* dst) : n(n), dst(dst) { }
+
+        void run(worker& w) override {
+          switch (state) {
+            case 0: {
+              state = 1;
+              f = w.spawn_future<ffib>(n);
+              return;
+            }
+            case 1: {
+              state = 2;
+              w.await(f);
+              return;
+            }
+            case 2: {
+              *dst = f.get();
+              w.finish();
+              return;
+            }
+          }
+        }
+
+      };
+
+      class value : public future_frame<long> {
+      public:
+
+        long v;
+
+        value(long v) : v(v) { }
+
+        void run(worker& w) override {
+          result = v;
+          w.finish();
+        }
+
+      };
+
+      static constexpr
+      int nb_many = 200;
+
+      /* Spawns nb_many futures in a row, checking where their cells
+       * go: the first ones at the end of this frame, and, once the
+       * chunk of the frame is full, on stacks of their own.
+       */
+      class many : public frame {
+      public:
+
+        future<long> fs[nb_many];
+
+        int i = 0;
+
+        int state = 0;
+
+        bool* ok;
+
+        many(bool* ok) : ok(ok) { }
+
+        void run(worker& w) override {
+          switch (state) {
+            case 0: {
+              fs[i] = w.spawn_future<value>(i);
+              // the future frame runs only in the next step
+              *ok = *ok && ! fs[i].ready();
+              if (++i == nb_many) {
+                i = 0;
+                state = 1;
+              }
+              return;
+            }
+            case 1: {
+              int nb_in_frame = 0;
+              for (auto& f : fs) {
+                if (! f.c->own_stack) {
+                  nb_in_frame++;
+                  *ok = *ok && (plus::chunk_of(f.c) == plus::chunk_of(this));
+                }
+              }
+              *ok = *ok && (nb_in_frame > 0) && (nb_in_frame < nb_many);
+              state = 2;
+              return;
+            }
+            case 2: {
+              w.await(fs[i]);
+              state = 3;
+              return;
+            }
+            case 3: {
+              *ok = *ok && fs[i].ready() && (fs[i].get() == i);
+              state = (++i == nb_many) ? 4 : 2;
+              return;
+            }
+            case 4: {
+              w.finish();
+              return;
+            }
+          }
+        }
+
+      };
+
+      // spawns a future and finishes without touching it
+      class leaver : public frame {
+      public:
+
+        future<long>* dst;
+
+        leaver(future<long>* dst) : dst(dst) { }
+
+        void run(worker& w) override {
+          if (dst->c == nullptr) {
+            *dst = w.spawn_future<value>(42);
+            return;
+          }
+          w.finish();
+        }
+
+      };
+
+      // fills its frame with garbage
+      class clobber : public frame {
+      public:
+
+        char buf[512];
+
+        void run(worker& w) override {
+          memset(buf, 0xff, sizeof(buf));
+          w.finish();
+        }
+
+      };
+
+      // touches a future that escaped the frame that spawned it
+      class escape_root : public frame {
+      public:
+
+        future<long> f;
+
+        long* dst;
+
+        int state = 0;
+
+        escape_root(long* dst) : dst(dst) { }
+
+        void run(worker& w) override {
+          switch (state) {
+            case 0: {
+              state = 1;
+              w.call<leaver>(&f);
+              return;
+            }
+            case 1: {
+              state = 2;
+              // reuses the memory of the cell, unless it is kept
+              w.call<clobber>();
+              return;
+            }
+            case 2: {
+              state = 3;
+              w.await(f);
+              return;
+            }
+            case 3: {
+              *dst = f.get();
+              w.finish();
+              return;
+            }
+          }
+        }
+
+      };
+
+    } // end namespace
+
+    void check_fib() {
+      for (int nb_workers = 1; nb_workers <= 4; nb_workers++) {
+        auto c = default_config();
+        c.nb_workers = nb_workers;
+        c.polling_interval = 1;
+        long r = -1;
+        launch<fib_root>(c, 18, &r);
+        assert(r == fib_seq(18));
+      }
+    }
+
+    void check_many() {
+      auto c = default_config();
+      c.nb_workers = 1;
+      bool ok = true;
+      launch<many>(c, &ok);
+      assert(ok);
+    }
+
+    void check_escape() {
+      auto c = default_config();
+      c.nb_workers = 1;
+      long r = -1;
+      launch<escape_root>(c, &r);
+      assert(r == 42);
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::runtime::check_fib();
+  cactus_stack::runtime::check_many();
+  cactus_stack::runtime::check_escape();
+  std::cout << "OK, futures" << std::endl;
+  return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <assert.h>
+
+#include "cactus-runtime.hpp"
+
+namespace cactus_stack {
+  namespace runtime {
+
+    namespace {
+
+      int pipe_fds[2];
+
+      std::atomic<bool> stolen(false);
+
+      std::atomic<bool> timed_out(false);
+
+      using clock_type = std::chrono::steady_clock;
+
+      /* Runs one step at a time, so that its worker polls in between,
+       * until the continuation of its parent runs, which it does only
+       * once the spinner is stolen.
+       */
+      class spinner : public frame {
+      public:
+
+        clock_type::time_point deadline = clock_type::now() + std::chrono::seconds(10);
+
+        void run(worker& w) override {
+          if (stolen.load()) {
+            w.finish();
+          } else if (clock_type::now() > deadline) {
+            timed_out.store(true);
+            w.finish();
+          }
+        }
+
+      };
+
+      /* Parks its stack on a read of a pipe that another thread
+       * writes to later, then, once the read completes, spawns a
+       * spinner, which must be stolen by the other worker for the
+       * spinner to finish.
+       */
+      class reader : public frame {
+      public:
+
+        char buf[4];
+
+        int res = 0;
+
+        int state = 0;
+
+        void run(worker& w) override {
+          switch (state) {
+            case 0: {
+              state = 1;
+              w.read(pipe_fds[0], buf, sizeof(buf), 0, &res);
+              return;
+            }
+            case 1: {
+              assert(res == (int)sizeof(buf));
+              state = 2;
+              w.spawn<spinner>();
+              return;
+            }
+            case 2: {
+              // the spinner, still running, is no longer on top
+              stolen.store(true);
+              state = 3;
+              w.sync();
+              return;
+            }
+            case 3: {
+              w.finish();
+              return;
+            }
+          }
+        }
+
+      };
+
+    } // end namespace
+
+    /* The worker that reaps the completion of the read leaves its
+     * request cell open to thieves.
+     */
+    void check_steal_after_read() {
+      for (int i = 0; i < 10; i++) {
+        int r = pipe(pipe_fds);
+        assert(r == 0);
+        (void)r;
+        stolen.store(false);
+        timed_out.store(false);
+        std::thread writer([] {
+          std::this_thread::sleep_for(std::chrono::milliseconds(20));
+          ssize_t nb = ::write(pipe_fds[1], "data", 4);
+          assert(nb == 4);
+          (void)nb;
+        });
+        auto c = default_config();
+        c.nb_workers = 2;
+        c.polling_interval = 1;
+        auto st = launch<reader>(c);
+        writer.join();
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        assert(! timed_out.load());
+        assert(stolen.load());
+        assert(st.nb_steals > 0);
+      }
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::runtime::check_steal_after_read();
+  std::cout << "OK, io" << std::endl;
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <assert.h>
+
+#include "cactus-plus.hpp"
+
+namespace cactus_stack {
+  namespace plus {
+
+    namespace {
+
+      auto is_splittable_fn = [] (char*) {
+        return false;
+      };
+
+      auto destruct_fn = [] (char*, shared_frame_type) { };
+
+      static_assert(join_counter, "build with CACTUS_STACK_JOIN_COUNTER=1");
+
+      stack_type push_frame(stack_type s, parent_link_type ty) {
+        return push_back<sizeof(long)>(s, ty, [] (char* p) {
+          *(long*)p = 0;
+        }, is_splittable_fn);
+      }
+
+      // a stack forked off, along with the index of the stack of its parent
+      class forked_stack {
+      public:
+
+        stack_type s;
+
+        int parent;
+
+        // children of the top frame of s that are not yet unwound
+        int nb_children = 0;
+
+        bool unwound = false;
+
+      };
+
+    } // end namespace
+
+    /* The root frame gets nb_children children, each one forked off
+     * by fork_marks along with a chain of async descendants, so that
+     * the top frame of every forked stack but the last of a chain
+     * is itself the parent of the next one. The stacks are then
+     * unwound in a random order in which no frame is popped before
+     * its children, and try_join must hold exactly when all the
+     * children of the top frame have been unwound.
+     */
+    void check_random_unwind(std::mt19937& rng, int nb_children) {
+      std::vector<forked_stack> fs;
+      // the remaining stack, whose top frame is the root
+      fs.push_back(forked_stack());
+      fs[0].parent = -1;
+      stack_type s = push_frame(create_stack(), Parent_link_sync);
+      for (int i = 0; i < nb_children; i++) {
+        int depth = std::uniform_int_distribution<int>(1, 3)(rng);
+        for (int j = 0; j < depth; j++) {
+          s = push_frame(s, Parent_link_async);
+          int nb_sync = std::uniform_int_distribution<int>(0, 2)(rng);
+          for (int k = 0; k < nb_sync; k++) {
+            s = push_frame(s, Parent_link_sync);
+          }
+        }
+        int parent = 0;
+        s = fork_marks(s, depth, [&] (stack_type t) {
+          forked_stack f;
+          f.s = t;
+          f.parent = parent;
+          fs[parent].nb_children++;
+          parent = (int)fs.size();
+          fs.push_back(f);
+        }, is_splittable_fn);
+        assert(parent == (int)fs.size() - 1);
+      }
+      fs[0].s = s;
+      assert(fs[0].nb_children == nb_children);
+      int nb_left = (int)fs.size() - 1;
+      while (nb_left > 0) {
+        for (auto& f : fs) {
+          if (! f.unwound) {
+            assert(try_join(f.s) == (f.nb_children == 0));
+          }
+        }
+        std::vector<int> ready;
+        for (int i = 1; i < (int)fs.size(); i++) {
+          if ((! fs[i].unwound) && (fs[i].nb_children == 0)) {
+            ready.push_back(i);
+          }
+        }
+        assert(! ready.empty());
+        int i = ready[std::uniform_int_distribution<int>(0, (int)ready.size() - 1)(rng)];
+        if (std::uniform_int_distribution<int>(0, 1)(rng) == 0) {
+          while (! empty(fs[i].s)) {
+            fs[i].s = pop_back(fs[i].s, destruct_fn);
+          }
+        } else {
+          destroy_stack(fs[i].s, destruct_fn);
+        }
+        fs[i].unwound = true;
+        fs[fs[i].parent].nb_children--;
+        nb_left--;
+      }
+      assert(try_join(s));
+      s = pop_back(s, destruct_fn);
+      assert(empty(s));
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  std::mt19937 rng(42);
+  for (int nb_children = 1; nb_children <= 8; nb_children++) {
+    for (int i = 0; i < 200; i++) {
+      cactus_stack::plus::check_random_unwind(rng, nb_children);
+    }
+  }
+  std::cout << "OK, join counters" << std::endl;
+  return 0;
+}
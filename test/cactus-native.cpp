@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <stdexcept>
+#include <assert.h>
+
+#include "cactus-native.hpp"
+
+namespace cactus_stack {
+  namespace native {
+
+    namespace {
+
+      // enough for a call of recurse, even at -O0
+      static constexpr
+      size_t frame_szb = 4096;
+
+      // number of segments entered at the deepest point of the last recursion
+      int max_nb_segments = 0;
+
+      int nb_segments() {
+        int n = 0;
+        for (segment_type* s = my_segment(); s != nullptr; s = s->pred) {
+          n++;
+        }
+        return n;
+      }
+
+      /* Recurses n levels deep, with a buffer in each level that must
+       * survive the calls below it, and throws at the bottom if asked.
+       */
+      long recurse(int n, bool throw_at_bottom) {
+        volatile char buf[512];
+        for (size_t i = 0; i < sizeof(buf); i++) {
+          buf[i] = (char)(n + i);
+        }
+        long r = 0;
+        if (n == 0) {
+          max_nb_segments = nb_segments();
+          if (throw_at_bottom) {
+            throw std::runtime_error("bottom");
+          }
+        } else {
+          check_stack(frame_szb, [&] {
+            r = recurse(n - 1, throw_at_bottom) + 1;
+          });
+        }
+        for (size_t i = 0; i < sizeof(buf); i++) {
+          assert(buf[i] == (char)(n + i));
+        }
+        return r;
+      }
+
+      // deep enough to overflow the 8 MB stack of the main thread, were it used
+      static constexpr
+      int depth = 30000;
+
+    } // end namespace
+
+    /* The recursion starts on a segment pushed by hand, on which the
+     * body also pushes a frame, and goes on on segments that check_stack
+     * takes from the segment stack.
+     */
+    void check_deep_recursion() {
+      stack_type s = plus::create_stack();
+      long r = 0;
+      s = call_on_segment(s, max_segment_szb, [&] (stack_type t) {
+        assert(stack_room() + reserve_szb < max_segment_szb);
+        t = plus::push_back<sizeof(long)>(t, plus::Parent_link_sync, [] (char* p) {
+          *(long*)p = 123;
+        }, [] (char*) {
+          return false;
+        });
+        r = recurse(depth, false);
+        assert(*(long*)plus::frame_data(t.fp) == 123);
+        return plus::pop_back(t, [] (char*, plus::shared_frame_type) { });
+      });
+      assert(r == depth);
+      assert(max_nb_segments > 2);
+      assert(plus::empty(s));
+      assert(my_segment() == nullptr);
+      assert(plus::empty(my_segment_stack()));
+    }
+
+    // an exception thrown at the bottom unwinds through every segment
+    void check_exception() {
+      stack_type s = plus::create_stack();
+      bool caught = false;
+      try {
+        s = call_on_segment(s, max_segment_szb, [&] (stack_type t) {
+          recurse(depth, true);
+          return t;
+        });
+      } catch (std::runtime_error&) {
+        caught = true;
+      }
+      assert(caught);
+      assert(max_nb_segments > 2);
+      assert(plus::empty(s));
+      assert(my_segment() == nullptr);
+      assert(plus::empty(my_segment_stack()));
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::native::check_deep_recursion();
+  cactus_stack::native::check_exception();
+  std::cout << "OK, native segments" << std::endl;
+  return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <random>
+#include <assert.h>
+
+#include "cactus-plus.hpp"
+
+namespace cactus_stack {
+  namespace plus {
+
+    namespace {
+
+      static_assert(persistent, "build with CACTUS_STACK_PERSISTENT=1");
+
+      auto is_splittable_fn = [] (char*) {
+        return false;
+      };
+
+      auto destruct_fn = [] (char*, shared_frame_type) { };
+
+      // frames of a few sizes, such that pushes often take new chunks
+      const size_t frame_szbs[] = { sizeof(long), 200, 1000 };
+
+      stack_type push_value(stack_type s, size_t nb, long v) {
+        return push_back(s, nb, Parent_link_sync, [&] (char* p) {
+          *(long*)p = v;
+        }, is_splittable_fn);
+      }
+
+      // a stack along with the values of its frames, from bottom to top
+      class model_stack {
+      public:
+
+        stack_type s;
+
+        std::deque<long> ref;
+
+      };
+
+      void check_same(const model_stack& m) {
+        frame_header_type* fp = m.s.fp;
+        for (auto it = m.ref.rbegin(); it != m.ref.rend(); it++) {
+          assert(fp != nullptr);
+          assert(*frame_data<long>(fp) == *it);
+          fp = fp->pred;
+        }
+        assert(fp == nullptr);
+        assert(empty(m.s) == m.ref.empty());
+      }
+
+    } // end namespace
+
+    /* A push on a stack whose top frame is shared places its frame in
+     * a new chunk, and leaves the frames of the snapshot as they were.
+     */
+    void check_copy_on_write() {
+      model_stack m1;
+      m1.s = create_stack();
+      for (long i = 0; i < 3; i++) {
+        m1.s = push_value(m1.s, sizeof(long), i);
+        m1.ref.push_back(i);
+      }
+      model_stack m2 = m1;
+      m2.s = snapshot(m1.s);
+      m1.s = push_value(m1.s, sizeof(long), 10);
+      m1.ref.push_back(10);
+      assert(chunk_of(m1.s.fp) != chunk_of(m2.s.fp));
+      m2.s = push_value(m2.s, sizeof(long), 20);
+      m2.ref.push_back(20);
+      assert(chunk_of(m2.s.fp) != chunk_of(m1.s.fp));
+      check_same(m1);
+      check_same(m2);
+      // the top chunk of m1 is its own, so the next push goes there
+      chunk_type* c = chunk_of(m1.s.fp);
+      m1.s = push_value(m1.s, sizeof(long), 11);
+      m1.ref.push_back(11);
+      assert(chunk_of(m1.s.fp) == c);
+      check_same(m1);
+      check_same(m2);
+      release_stack(m1.s);
+      check_same(m2);
+      while (! empty(m2.s)) {
+        m2.s = pop_back(m2.s, destruct_fn);
+        m2.ref.pop_back();
+        check_same(m2);
+      }
+    }
+
+    /* Random pushes, pops, snapshots and releases on a set of stacks,
+     * each one checked after every step against a reference deque.
+     */
+    void check_random(std::mt19937& rng, int nb_steps) {
+      std::vector<model_stack> ms(1);
+      ms[0].s = create_stack();
+      long next_value = 0;
+      for (int i = 0; i < nb_steps; i++) {
+        size_t k = std::uniform_int_distribution<size_t>(0, ms.size() - 1)(rng);
+        model_stack& m = ms[k];
+        int op = std::uniform_int_distribution<int>(0, 9)(rng);
+        if (op < 5) {
+          size_t nb = frame_szbs[std::uniform_int_distribution<int>(0, 2)(rng)];
+          m.s = push_value(m.s, nb, next_value);
+          m.ref.push_back(next_value++);
+        } else if (op < 8) {
+          if (! m.ref.empty()) {
+            m.s = pop_back(m.s, destruct_fn);
+            m.ref.pop_back();
+          }
+        } else if ((op == 8) && (ms.size() < 16)) {
+          model_stack m2 = m;
+          m2.s = snapshot(m.s);
+          ms.push_back(m2);
+        } else if ((op == 9) && (ms.size() > 1)) {
+          release_stack(m.s);
+          ms.erase(ms.begin() + k);
+        }
+        for (auto& m : ms) {
+          check_same(m);
+        }
+      }
+      for (auto& m : ms) {
+        release_stack(m.s);
+      }
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::plus::check_copy_on_write();
+  std::mt19937 rng(42);
+  for (int i = 0; i < 50; i++) {
+    cactus_stack::plus::check_random(rng, 1000);
+  }
+  std::cout << "OK, persistent stacks" << std::endl;
+  return 0;
+}
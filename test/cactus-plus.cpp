@@ -10,9 +10,11 @@
 #include <iostream>
 #include <memory>
 #include <deque>
+#include <vector>
 #include <set>
 #include <cmath>
 #include <string>
+#include <cstring>
 #include <time.h>
 #include "quickcheck.hh"
 
@@ -152,6 +154,19 @@ namespace cactus_stack {
       return std::make_pair(Fork_result_loop_split, k);
     }
     
+    // index of the frame of a forked-off stack s at which fork_marks forks
+    // off the next stack, or zero if there is none; the loop child of a
+    // splittable frame is a mark too, at which fork_marks stops
+    size_t next_fork_index(const reference_stack_type& s) {
+      auto nb_frames = s.size();
+      for (size_t i = 1; i < nb_frames; i++) {
+        if (is_marked(s[i]) || is_splittable(s[i - 1].p)) {
+          return (s[i].s.plt == Parent_link_async) ? i : 0;
+        }
+      }
+      return 0;
+    }
+    
     fork_result_type fork_mark(reference_stack_type& s) {
       fork_result_type r;
       auto _p = fork_mark_info(s);
@@ -190,7 +205,9 @@ namespace cactus_stack {
     
     using trace_tag_type = enum {
       Trace_push_back, Trace_pop_back, Trace_fork_mark,
-      Trace_split_mark, Trace_nil
+      Trace_split_mark, Trace_destroy_stack,
+      Trace_pop_until, Trace_replace_back,
+      Trace_extend_back, Trace_set_splittable, Trace_nil
     };
     
     struct trace_struct {
@@ -205,6 +222,10 @@ namespace cactus_stack {
       struct {
         std::shared_ptr<struct trace_struct> k1;
         std::shared_ptr<struct trace_struct> k2;
+        // when nonzero, fork by fork_mark_copy with this threshold
+        size_t copy_szb = 0;
+        // when true, the fork is done by the fork_marks of the enclosing fork
+        bool fused = false;
       } fork_mark;
       struct {
         std::shared_ptr<struct trace_struct> k11;
@@ -212,6 +233,30 @@ namespace cactus_stack {
         std::shared_ptr<struct trace_struct> k2;
         std::shared_ptr<struct trace_struct> k;
       } split_mark;
+      struct {
+        bool trivial = false;
+      } destroy_stack;
+      struct {
+        size_t nb = 0;
+        bool trivial = false;
+        std::shared_ptr<struct trace_struct> k;
+      } pop_until;
+      struct {
+        frame f;
+        bool big = false;
+        std::shared_ptr<struct trace_struct> k;
+      } replace_back;
+      struct {
+        size_t nb = 0;
+        std::shared_ptr<struct trace_struct> k;
+      } extend_back;
+      struct {
+        // new number of iterations of the frame
+        size_t nb = 0;
+        // number of frames above the frame, 0 for the top frame
+        size_t depth = 0;
+        std::shared_ptr<struct trace_struct> k;
+      } set_splittable;
     };
     
     using trace_type = struct trace_struct;
@@ -241,11 +286,53 @@ namespace cactus_stack {
       return std::make_shared<trace_type>(t);
     }
     
+    std::shared_ptr<trace_type> mk_destroy_stack(bool trivial) {
+      trace_type t;
+      t.tag = Trace_destroy_stack;
+      t.destroy_stack.trivial = trivial;
+      return std::make_shared<trace_type>(t);
+    }
+    
+    std::shared_ptr<trace_type> mk_pop_until(size_t nb, bool trivial) {
+      trace_type t;
+      t.tag = Trace_pop_until;
+      t.pop_until.nb = nb;
+      t.pop_until.trivial = trivial;
+      return std::make_shared<trace_type>(t);
+    }
+    
+    std::shared_ptr<trace_type> mk_replace_back(frame f, bool big) {
+      trace_type t;
+      t.tag = Trace_replace_back;
+      t.replace_back.f = f;
+      t.replace_back.big = big;
+      return std::make_shared<trace_type>(t);
+    }
+    
+    std::shared_ptr<trace_type> mk_extend_back(size_t nb) {
+      trace_type t;
+      t.tag = Trace_extend_back;
+      t.extend_back.nb = nb;
+      return std::make_shared<trace_type>(t);
+    }
+    
+    std::shared_ptr<trace_type> mk_set_splittable(size_t nb, size_t depth) {
+      trace_type t;
+      t.tag = Trace_set_splittable;
+      t.set_splittable.nb = nb;
+      t.set_splittable.depth = depth;
+      return std::make_shared<trace_type>(t);
+    }
+    
     void print_trace(std::ostream& out, std::shared_ptr<trace_type> t, const std::string& prefix, bool is_tail) {
       out << (prefix + (is_tail ? "└── " : "├── "));
       switch (t->tag) {
         case Trace_fork_mark: {
-          out << "*" << std::endl;
+          out << (t->fork_mark.fused ? "+" : "*");
+          if (t->fork_mark.copy_szb > 0) {
+            out << "(" << t->fork_mark.copy_szb << ")";
+          }
+          out << std::endl;
           if (t->fork_mark.k1) {
             print_trace(out, t->fork_mark.k1, prefix + (is_tail ? "    " : "│   "), false);
           }
@@ -288,6 +375,42 @@ namespace cactus_stack {
           }
           break;
         }
+        case Trace_destroy_stack: {
+          out << "x" << (t->destroy_stack.trivial ? "{}" : "{~}") << std::endl;
+          break;
+        }
+        case Trace_pop_until: {
+          out << "-" << t->pop_until.nb << (t->pop_until.trivial ? "{}" : "{~}") << std::endl;
+          if (t->pop_until.k) {
+            print_trace(out, t->pop_until.k, prefix + (is_tail ? "    " : "│   "), true);
+          }
+          break;
+        }
+        case Trace_replace_back: {
+          auto plt = t->replace_back.f.s.plt;
+          auto plt_s = (plt == Parent_link_async ? "A" : "S");
+          frame& f = t->replace_back.f;
+          auto sv = (f.s.p != nullptr) ? f.s.p->v : f.s.v;
+          out << "={p.v=" << f.p.v << ", s.v=" << sv << ", ty=" << plt_s << ", nb=" << f.p.nb_iters() << "}" << std::endl;
+          if (t->replace_back.k) {
+            print_trace(out, t->replace_back.k, prefix + (is_tail ? "    " : "│   "), true);
+          }
+          break;
+        }
+        case Trace_extend_back: {
+          out << ">" << t->extend_back.nb << std::endl;
+          if (t->extend_back.k) {
+            print_trace(out, t->extend_back.k, prefix + (is_tail ? "    " : "│   "), true);
+          }
+          break;
+        }
+        case Trace_set_splittable: {
+          out << "~" << t->set_splittable.nb << "@" << t->set_splittable.depth << std::endl;
+          if (t->set_splittable.k) {
+            print_trace(out, t->set_splittable.k, prefix + (is_tail ? "    " : "│   "), true);
+          }
+          break;
+        }
         case Trace_nil: {
           break;
         }
@@ -301,6 +424,8 @@ namespace cactus_stack {
       print_trace(out, t, "", true);
     }
     
+    std::shared_ptr<trace_type> gen_random_fork_rest(const std::deque<frame>&, int);
+    
     std::shared_ptr<trace_type> gen_random_trace(const std::deque<frame>& prefix, int d) {
       std::shared_ptr<trace_type> r;
       auto np = prefix.size();
@@ -312,21 +437,54 @@ namespace cactus_stack {
       size_t k = _p.second;
       if ((ft == Fork_result_fork) && (quickcheck::generateInRange(0, d - 1) == 0)) {
         r = mk_fork_mark();
+        if (flip_coin()) {
+          r->fork_mark.copy_szb = quickcheck::generateInRange(1, K);
+        }
         auto pk = prefix.begin() + k;
         std::deque<frame> prefix1(prefix.begin(), pk);
         std::deque<frame> prefix2(pk, prefix.end());
         r->fork_mark.k1 = gen_random_trace(prefix1, d + 1);
-        r->fork_mark.k2 = gen_random_trace(prefix2, d + 1);
+        if (r->fork_mark.copy_szb == 0) {
+          r->fork_mark.k2 = gen_random_fork_rest(prefix2, d + 1);
+        } else {
+          r->fork_mark.k2 = gen_random_trace(prefix2, d + 1);
+        }
       } else if ((ft == Fork_result_loop_split) && (quickcheck::generateInRange(0, d - 1) == 0)) {
         r = mk_split_mark();
         auto pk = prefix.begin() + (k + 1);
         std::deque<frame> prefix1(prefix.begin(), pk);
-        prefix1.pop_back();
+        // the loop frame stays on the stack, with all of its iterations handed out
+        prefix1.back().p.lo = prefix1.back().p.hi;
         std::deque<frame> prefix2(pk, prefix.end());
         r->split_mark.k11 = gen_random_trace({ }, d + 1);
         r->split_mark.k12 = gen_random_trace(prefix2, d + 1);
         r->split_mark.k2 = gen_random_trace({ }, d + 1);
         r->split_mark.k = gen_random_trace(prefix1, d + 1);
+      } else if (quickcheck::generateInRange(0, 15) == 0) {
+        r = mk_destroy_stack(flip_coin());
+      } else if (quickcheck::generateInRange(0, 7) == 0) {
+        size_t nb = quickcheck::generateInRange(1, (int)np);
+        std::deque<frame> prefix2(prefix.begin(), prefix.end() - nb);
+        r = mk_pop_until(nb, flip_coin());
+        r->pop_until.k = gen_random_trace(prefix2, d);
+      } else if (quickcheck::generateInRange(0, 7) == 0) {
+        auto f = gen_random_frame();
+        std::deque<frame> prefix2(prefix);
+        prefix2.pop_back();
+        prefix2.push_back(f);
+        r = mk_replace_back(f, flip_coin());
+        r->replace_back.k = gen_random_trace(prefix2, d);
+      } else if (quickcheck::generateInRange(0, 7) == 0) {
+        r = mk_extend_back(quickcheck::generateInRange(1, 512));
+        r->extend_back.k = gen_random_trace(prefix, d);
+      } else if (quickcheck::generateInRange(0, 7) == 0) {
+        size_t nb = quickcheck::generateInRange(0, 3);
+        size_t depth = flip_coin() ? 0 : quickcheck::generateInRange(0, (int)np - 1);
+        std::deque<frame> prefix2(prefix);
+        auto& f = prefix2[np - 1 - depth];
+        f.p.hi = f.p.lo + nb;
+        r = mk_set_splittable(nb, depth);
+        r->set_splittable.k = gen_random_trace(prefix2, d);
       } else if (quickcheck::generateInRange(0, (2 + (1 << np)) - 1) < 3) {
         auto f = gen_random_frame();
         std::deque<frame> prefix2(prefix);
@@ -342,6 +500,23 @@ namespace cactus_stack {
       return r;
     }
     
+    // the trace of a forked-off stack, which may start with further forks
+    // to be done in the same pass, by fork_marks
+    std::shared_ptr<trace_type> gen_random_fork_rest(const std::deque<frame>& prefix, int d) {
+      size_t j = next_fork_index(prefix);
+      if ((j == 0) || flip_coin()) {
+        return gen_random_trace(prefix, d);
+      }
+      auto r = mk_fork_mark();
+      r->fork_mark.fused = true;
+      auto pj = prefix.begin() + j;
+      std::deque<frame> prefix1(prefix.begin(), pj);
+      std::deque<frame> prefix2(pj, prefix.end());
+      r->fork_mark.k1 = gen_random_trace(prefix1, d + 1);
+      r->fork_mark.k2 = gen_random_fork_rest(prefix2, d + 1);
+      return r;
+    }
+    
     std::shared_ptr<trace_type> gen_random_trace() {
       std::deque<frame> prefix;
       auto f = gen_random_frame();
@@ -489,17 +664,29 @@ namespace cactus_stack {
     
     bool is_finished(std::shared_ptr<machine_config_type>);
     
+    // reclaims for the thread m1 the space left by the finished thread m2
+    std::shared_ptr<machine_config_type> join(std::shared_ptr<machine_config_type> m1,
+                                              std::shared_ptr<machine_config_type> m2) {
+      if ((m1->tag != Machine_thread) || (m2->tag != Machine_thread) || ! is_finished(m2)) {
+        return m1;
+      }
+      auto n1 = std::make_shared<machine_config_type>(*m1);
+      n1->thread.ms = join_mark(m1->thread.ms, m2->thread.ms);
+      return n1;
+    }
+    
     std::shared_ptr<machine_config_type> step(std::shared_ptr<machine_config_type> m) {
       machine_config_type n;
       n.tag = Machine_stuck;
       switch (m->tag) {
         case Machine_fork_mark: {
           n.tag = Machine_fork_mark;
+          auto m1 = join(m->fork_mark.m1, m->fork_mark.m2);
           if (flip_coin()) {
-            n.fork_mark.m1 = step(m->fork_mark.m1);
+            n.fork_mark.m1 = step(m1);
             n.fork_mark.m2 = m->fork_mark.m2;
           } else {
-            n.fork_mark.m1 = m->fork_mark.m1;
+            n.fork_mark.m1 = m1;
             n.fork_mark.m2 = step(m->fork_mark.m2);
           }
           break;
@@ -513,7 +700,7 @@ namespace cactus_stack {
             n.split_mark.m11 = m->split_mark.m11;
             n.split_mark.m12 = m->split_mark.m12;
             n.split_mark.m2 = m->split_mark.m2;
-            n.split_mark.k = step(m->split_mark.k);
+            n.split_mark.k = step(join(m->split_mark.k, m->split_mark.m12));
           } else if (flip_coin()) {
             if (finished_m12) {
               n.split_mark.m11 = step(m->split_mark.m11);
@@ -545,10 +732,59 @@ namespace cactus_stack {
           switch (tc_m.t->tag) {
             case Trace_fork_mark: {
               auto fr = fork_mark(tc_m.rs);
+              std::vector<std::shared_ptr<trace_type>> fused;
+              for (auto t = tc_m.t->fork_mark.k2; t && (t->tag == Trace_fork_mark) && t->fork_mark.fused; t = t->fork_mark.k2) {
+                fused.push_back(t);
+              }
+              if ((fr.tag == Fork_result_fork) && ! fused.empty()) {
+                std::vector<stack_type> mss;
+                auto ms1 = fork_marks(tc_m.ms, (int)fused.size() + 1, [&] (stack_type t) {
+                  mss.push_back(t);
+                }, is_splittable_fn);
+                // forked-off stacks that fork_marks fails to produce are
+                // caught by the consistency check
+                mss.resize(fused.size() + 1, create_stack());
+                reference_stack_type rs1 = fr.fork.s1;
+                rs1.push_back(fr.fork.f1);
+                reference_stack_type rest = fr.fork.s2;
+                rest.push_front(fr.fork.f2);
+                auto mk = [&] (std::shared_ptr<trace_type> t, stack_type ms, reference_stack_type rs) {
+                  auto m = mk_mc_thread();
+                  m->thread.t = t;
+                  m->thread.ms = ms;
+                  m->thread.rs = rs;
+                  return m;
+                };
+                // the last forked-off stack holds the top of the stack
+                auto mlast = mk(fused.back()->fork_mark.k2, mss.back(), { });
+                std::vector<std::shared_ptr<machine_config_type>> ms;
+                ms.push_back(mk(tc_m.t->fork_mark.k1, ms1, rs1));
+                for (size_t i = 0; i < fused.size(); i++) {
+                  size_t j = next_fork_index(rest);
+                  reference_stack_type rsi(rest.begin(), rest.begin() + j);
+                  rest.erase(rest.begin(), rest.begin() + j);
+                  ms.push_back(mk(fused[i]->fork_mark.k1, mss[i], rsi));
+                }
+                mlast->thread.rs = rest;
+                std::shared_ptr<machine_config_type> m2 = mlast;
+                for (size_t i = ms.size(); i > 1; i--) {
+                  auto mf = std::make_shared<machine_config_type>();
+                  mf->tag = Machine_fork_mark;
+                  mf->fork_mark.m1 = ms[i - 1];
+                  mf->fork_mark.m2 = m2;
+                  m2 = mf;
+                }
+                n.tag = Machine_fork_mark;
+                n.fork_mark.m1 = ms[0];
+                n.fork_mark.m2 = m2;
+                break;
+              }
               switch (fr.tag) {
                 case Fork_result_fork:
                 case Fork_result_none: {
-                  auto mp = fork_mark(tc_m.ms, is_splittable_fn);
+                  auto copy_szb = tc_m.t->fork_mark.copy_szb;
+                  auto mp = (copy_szb == 0) ? fork_mark(tc_m.ms, is_splittable_fn)
+                                            : fork_mark_copy(tc_m.ms, copy_szb, [] (char*, std::ptrdiff_t) { }, is_splittable_fn);
                   reference_stack_type rs1, rs2;
                   n.tag = Machine_fork_mark;
                   if (fr.tag == Fork_result_fork) {
@@ -687,6 +923,113 @@ namespace cactus_stack {
               tc_n.t = tc_m.t->pop_back.k;
               break;
             }
+            case Trace_destroy_stack: {
+              n.tag = Machine_thread;
+              if (tc_m.t->destroy_stack.trivial) {
+                destroy_stack(tc_m.ms);
+              } else {
+                destroy_stack(tc_m.ms, [&] (char* p, shared_frame_type) {
+                  ((frame*)(p))->~frame();
+                });
+              }
+              tc_n.ms = create_stack();
+              tc_n.t = nullptr;
+              break;
+            }
+            case Trace_pop_until: {
+              n.tag = Machine_thread;
+              size_t nb = tc_m.t->pop_until.nb;
+              tc_n.rs = tc_m.rs;
+              frame_header_type* target = tc_m.ms.fp;
+              for (size_t i = 0; i < nb; i++) {
+                tc_n.rs.pop_back();
+                target = target->pred;
+              }
+              if (tc_m.t->pop_until.trivial) {
+                tc_n.ms = pop_until(tc_m.ms, target);
+              } else {
+                tc_n.ms = pop_until(tc_m.ms, target, [&] (char* p, shared_frame_type) {
+                  ((frame*)(p))->~frame();
+                });
+              }
+              tc_n.t = tc_m.t->pop_until.k;
+              break;
+            }
+            case Trace_replace_back: {
+              frame f = tc_m.t->replace_back.f;
+              n.tag = Machine_thread;
+              tc_n.rs = tc_m.rs;
+              tc_n.rs.pop_back();
+              tc_n.rs.push_back(f);
+              auto destruct_fn = [&] (char* p, shared_frame_type) {
+                ((frame*)(p))->~frame();
+              };
+              auto initialize_fn = [&] (char* p) {
+                new ((frame*)p) frame(f);
+              };
+              if (tc_m.t->replace_back.big) {
+                tc_n.ms = replace_back<2 * sizeof(frame)>(tc_m.ms, f.s.plt, destruct_fn, initialize_fn, is_splittable_fn);
+              } else {
+                tc_n.ms = replace_back<sizeof(frame)>(tc_m.ms, f.s.plt, destruct_fn, initialize_fn, is_splittable_fn);
+              }
+              // the new frame is placed as push_back would place it
+              assert(! cache_align || (f.s.plt != Parent_link_async) ||
+                     (tc_n.ms.fp == align_to_cache_line(tc_n.ms.fp)));
+              tc_n.t = tc_m.t->replace_back.k;
+              break;
+            }
+            case Trace_extend_back: {
+              n.tag = Machine_thread;
+              size_t nb = tc_m.t->extend_back.nb;
+              tc_n.rs = tc_m.rs;
+              auto r = extend_back(tc_m.ms, nb);
+              tc_n.ms = r.first;
+              if (r.second != nullptr) {
+                // clobbers anything that would wrongly share the space
+                memset(r.second, 0xff, nb);
+              }
+              tc_n.t = tc_m.t->extend_back.k;
+              break;
+            }
+            case Trace_set_splittable: {
+              n.tag = Machine_thread;
+              size_t nb = tc_m.t->set_splittable.nb;
+              size_t depth = tc_m.t->set_splittable.depth;
+              tc_n.rs = tc_m.rs;
+              auto& f = tc_n.rs[tc_n.rs.size() - 1 - depth];
+              f.p.hi = f.p.lo + nb;
+              auto fp = tc_m.ms.fp;
+              for (size_t i = 0; i < depth; i++) {
+                fp = fp->pred;
+              }
+              auto& p = frame_data<frame>(fp)->p;
+              p.hi = p.lo + nb;
+              tc_n.ms = set_splittable(tc_m.ms, fp, is_splittable(p), is_splittable_fn);
+              // update_mark_stack, run by the consistency check, would
+              // hide a frame missing from the mark list
+              auto in_mark_list = [&] (frame_header_type* f) {
+                bool found = false;
+                for (auto m = tc_n.ms.mhd; m != nullptr; m = m->ext.succ) {
+                  found = found || (m == f);
+                }
+                return found;
+              };
+              bool marked = is_splittable(p) || (fp->ext.clt == Call_link_async) ||
+                            (fp->ext.llt == Loop_link_child);
+              assert(marked == in_mark_list(fp));
+              assert((depth > 0) || (marked == (tc_n.ms.mtl == fp)));
+              if (depth > 0) {
+                // the frame just above fp is its loop child iff fp is splittable
+                auto c = tc_n.ms.fp;
+                while (c->pred != fp) {
+                  c = c->pred;
+                }
+                assert((c->ext.llt == Loop_link_child) == is_splittable(p));
+                assert(is_mark_frame(c, is_splittable_fn) == in_mark_list(c));
+              }
+              tc_n.t = tc_m.t->set_splittable.k;
+              break;
+            }
             default: {
               assert(false);
             }
@@ -969,6 +1312,22 @@ namespace cactus_stack {
       r = r && equals(mf_r, mff_m);
       auto mfb_m = marked_frames_bkw(tc.ms.mtl);
       r = r && equals(mf_r, mfb_m);
+      auto pe = estimate_parallelism(tc.ms, [] (char* _fp) {
+        return (long)((frame*)_fp)->p.nb_iters();
+      }, [] (char* _fp) {
+        return is_splittable(((frame*)_fp)->p);
+      });
+      long nb_iters = 0;
+      for (auto& f : mf_r) {
+        if (is_splittable(f.p)) {
+          nb_iters += f.p.nb_iters();
+        }
+      }
+      // the mark list may still hold frames that are no longer marked
+      r = r && (pe.nb_marks >= (int)mf_r.size());
+      r = r && (pe.nb_iters == nb_iters);
+      // the count that the stack keeps as it goes
+      r = r && (tc.ms.par.nb_marks == pe.nb_marks);
       return r;
     }
     
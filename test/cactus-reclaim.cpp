@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <assert.h>
+
+#include "cactus-plus.hpp"
+
+namespace cactus_stack {
+  namespace plus {
+
+    namespace {
+
+      auto is_splittable_fn = [] (char*) {
+        return false;
+      };
+
+      auto destruct_fn = [] (char*, shared_frame_type) { };
+
+      // frames large enough that each takes a chunk of its own
+      static constexpr
+      int big_frame_szb = (K - sizeof(chunk_header_type)) / 2 + 8;
+
+      // more chunks than the chunk cache keeps, so that some are freed
+      static constexpr
+      int nb_chunks = 4 * max_nb_local_chunks;
+
+      static_assert(deferred_reclaim, "build with CACTUS_STACK_DEFERRED_RECLAIM=1");
+
+    } // end namespace
+
+    /* A reader walks the frames of the stack of the owner, from
+     * inside read sections, while the owner pushes and pops chunks.
+     * The chunks that the reader reaches must stay allocated until
+     * it leaves its read section, which AddressSanitizer checks.
+     */
+    void check_concurrent_reader() {
+      std::atomic<frame_header_type*> top(nullptr);
+      std::atomic<bool> done(false);
+      std::atomic<long> nb_visited(0);
+      std::thread reader([&] {
+        while (! done.load()) {
+          read_guard g;
+          frame_header_type* fp = top.load(std::memory_order_acquire);
+          long n = 0;
+          for (; (fp != nullptr) && (n < nb_chunks); n++) {
+            fp = fp->pred;
+          }
+          nb_visited += n;
+        }
+      });
+      stack_type s = create_stack();
+      for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < nb_chunks; i++) {
+          s = push_back<big_frame_szb>(s, Parent_link_sync, [] (char*) { }, is_splittable_fn);
+          top.store(s.fp, std::memory_order_release);
+        }
+        while (! empty(s)) {
+          s = pop_back(s, destruct_fn);
+          top.store(s.fp, std::memory_order_release);
+        }
+      }
+      done.store(true);
+      reader.join();
+      assert(nb_visited.load() > 0);
+      reclaim_chunks();
+      reclaim_chunks();
+      assert(my_epoch_participant().nb_retired == 0);
+    }
+
+    /* A reader that stays in its read section keeps every chunk
+     * retired since then, and the owner backs off from scanning its
+     * retire list, until the reader leaves.
+     */
+    void check_stalled_reader() {
+      std::atomic<int> state(0);
+      std::thread reader([&] {
+        read_guard g;
+        state.store(1);
+        while (state.load() != 2) {
+          std::this_thread::yield();
+        }
+      });
+      while (state.load() != 1) {
+        std::this_thread::yield();
+      }
+      epoch_participant& p = my_epoch_participant();
+      stack_type s = create_stack();
+      for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < nb_chunks; i++) {
+          s = push_back<big_frame_szb>(s, Parent_link_sync, [] (char*) { }, is_splittable_fn);
+        }
+        destroy_stack(s, destruct_fn);
+        s = create_stack();
+      }
+      assert(p.nb_retired >= 19 * nb_chunks);
+      assert(p.reclaim_at > p.nb_retired);
+      state.store(2);
+      reader.join();
+      reclaim_chunks();
+      reclaim_chunks();
+      assert(p.nb_retired == 0);
+      assert(p.reclaim_at == reclaim_period);
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::plus::check_concurrent_reader();
+  cactus_stack::plus::check_stalled_reader();
+  std::cout << "OK, deferred reclamation" << std::endl;
+  return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <atomic>
+#include <utility>
+#include <assert.h>
+
+#include "cactus-runtime.hpp"
+
+namespace cactus_stack {
+  namespace runtime {
+
+    namespace {
+
+      std::atomic<long> nb_constructed(0);
+
+      std::atomic<long> nb_destructed(0);
+
+      class sum : public reduce_frame<sum, long> {
+      public:
+
+        sum(size_t lo, size_t hi, long* dst)
+          : reduce_frame<sum, long>(lo, hi, 0, dst) {
+          nb_constructed++;
+        }
+
+        sum(const sum& other)
+          : reduce_frame<sum, long>(other) {
+          nb_constructed++;
+        }
+
+        ~sum() {
+          nb_destructed++;
+        }
+
+        void body(size_t i) {
+          acc += (long)i;
+        }
+
+      };
+
+      // a range [first, second) of iterations, empty when first < 0
+      using range_type = std::pair<long, long>;
+
+      const range_type no_range(-1, -1);
+
+      std::atomic<bool> out_of_order(false);
+
+      // concatenates adjacent ranges, which is not commutative
+      class concat {
+      public:
+
+        range_type operator()(range_type a, range_type b) {
+          if (a.first < 0) {
+            return b;
+          }
+          if (b.first < 0) {
+            return a;
+          }
+          if (a.second != b.first) {
+            out_of_order.store(true);
+          }
+          return range_type(a.first, b.second);
+        }
+
+      };
+
+      class ranges : public reduce_frame<ranges, range_type, concat> {
+      public:
+
+        ranges(size_t lo, size_t hi, range_type* dst)
+          : reduce_frame<ranges, range_type, concat>(lo, hi, no_range, dst) { }
+
+        void body(size_t i) {
+          acc = concat()(acc, range_type((long)i, (long)i + 1));
+        }
+
+      };
+
+      config_type splitting_config(int nb_workers) {
+        config_type c = default_config();
+        c.nb_workers = nb_workers;
+        c.polling_interval = 1;
+        return c;
+      }
+
+    } // end namespace
+
+    // every piece split off is combined once, and then destroyed
+    void check_sum() {
+      static constexpr
+      size_t n = 200000;
+      long nb_splits = 0;
+      for (int nb_workers = 1; nb_workers <= 4; nb_workers++) {
+        nb_constructed.store(0);
+        nb_destructed.store(0);
+        long r = -1;
+        auto st = launch<sum>(splitting_config(nb_workers), 0, n, &r);
+        assert(r == (long)(n * (n - 1) / 2));
+        assert(nb_constructed.load() == st.nb_splits + 1);
+        assert(nb_destructed.load() == nb_constructed.load());
+        nb_splits += st.nb_splits;
+      }
+      assert(nb_splits > 0);
+    }
+
+    // the results of the pieces are combined in the order of the iterations
+    void check_order() {
+      static constexpr
+      size_t n = 100000;
+      for (int nb_workers = 1; nb_workers <= 4; nb_workers++) {
+        out_of_order.store(false);
+        range_type r = no_range;
+        launch<ranges>(splitting_config(nb_workers), 0, n, &r);
+        assert(! out_of_order.load());
+        assert(r == range_type(0, (long)n));
+      }
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::runtime::check_sum();
+  cactus_stack::runtime::check_order();
+  std::cout << "OK, reduce_frame" << std::endl;
+  return 0;
+}
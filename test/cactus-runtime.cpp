@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <assert.h>
+#include <unistd.h>
+
+#include "cactus-runtime.hpp"
+
+namespace cactus_stack {
+  namespace runtime {
+
+    namespace {
+
+      std::atomic<long> nb_constructed(0);
+
+      std::atomic<long> nb_destructed(0);
+
+      // number of frames that ran past their sync
+      std::atomic<long> nb_joined(0);
+
+      long fib_seq(int n) {
+        return (n < 2) ? n : fib_seq(n - 1) + fib_seq(n - 2);
+      }
+
+      // number of calls of fib_seq(n) that make calls
+      long nb_inner(int n) {
+        return (n < 2) ? 0 : 1 + nb_inner(n - 1) + nb_inner(n - 2);
+      }
+
+      /* Spawns fib(n - 1), which thieves may take, and calls
+       * fib(n - 2). Children count themselves in their parent as
+       * they finish, such that a parent resumed before both are done
+       * fails, and one resumed twice counts twice in nb_joined.
+       */
+      class fib : public frame {
+      public:
+
+        int n;
+
+        long* dst;
+
+        std::atomic<int>* done;
+
+        long a, b;
+
+        std::atomic<int> nb_done;
+
+        int state = 0;
+
+        fib(int n, long* dst, std::atomic<int>* done = nullptr)
+          : n(n), dst(dst), done(done) {
+          nb_done.store(0);
+          nb_constructed++;
+        }
+
+        ~fib() {
+          nb_destructed++;
+        }
+
+        void run(worker& w) override {
+          switch (state) {
+            case 0: {
+              if (n < 2) {
+                *dst = n;
+                finish(w);
+                return;
+              }
+              state = 1;
+              w.spawn<fib>(n - 1, &a, &nb_done);
+              return;
+            }
+            case 1: {
+              state = 2;
+              w.call<fib>(n - 2, &b, &nb_done);
+              return;
+            }
+            case 2: {
+              state = 3;
+              w.sync();
+              return;
+            }
+            case 3: {
+              assert(nb_done.load() == 2);
+              nb_joined++;
+              *dst = a + b;
+              finish(w);
+              return;
+            }
+          }
+        }
+
+        void finish(worker& w) {
+          if (done != nullptr) {
+            done->fetch_add(1);
+          }
+          w.finish();
+        }
+
+      };
+
+      // counts the visits of each iteration, which must be one
+      class visit : public loop_frame<visit> {
+      public:
+
+        std::atomic<int>* counts;
+
+        visit(size_t lo, size_t hi, std::atomic<int>* counts)
+          : loop_frame<visit>(lo, hi), counts(counts) {
+          nb_constructed++;
+        }
+
+        visit(const visit& other)
+          : loop_frame<visit>(other), counts(other.counts) {
+          nb_constructed++;
+        }
+
+        ~visit() {
+          nb_destructed++;
+        }
+
+        void body(size_t i) {
+          counts[i]++;
+        }
+
+      };
+
+      void nap(int ms) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+      }
+
+      // naps in a first step, when its parent is a mark that thieves may take
+      class napper : public frame {
+      public:
+
+        int state = 0;
+
+        napper() {
+          nb_constructed++;
+        }
+
+        ~napper() {
+          nb_destructed++;
+        }
+
+        void run(worker& w) override {
+          if (state++ == 0) {
+            nap(20);
+            return;
+          }
+          w.finish();
+        }
+
+      };
+
+      /* Naps in nb_naps steps, in which its worker turns down the
+       * requests of thieves, long enough for them to park, then
+       * spawns nb_children nappers, one after the other.
+       */
+      class sleeper : public frame {
+      public:
+
+        int nb_naps;
+
+        int nb_children;
+
+        int state = 0;
+
+        sleeper(int nb_naps, int nb_children)
+          : nb_naps(nb_naps), nb_children(nb_children) {
+          nb_constructed++;
+        }
+
+        ~sleeper() {
+          nb_destructed++;
+        }
+
+        void run(worker& w) override {
+          if (nb_naps > 0) {
+            nb_naps--;
+            nap(10);
+            return;
+          }
+          if (state < nb_children) {
+            state++;
+            w.spawn<napper>();
+            return;
+          }
+          if (state == nb_children) {
+            state++;
+            w.sync();
+            return;
+          }
+          w.finish();
+        }
+
+      };
+
+      config_type stealing_config(int nb_workers) {
+        config_type c = default_config();
+        c.nb_workers = nb_workers;
+        c.polling_interval = 1;
+        return c;
+      }
+
+    } // end namespace
+
+    // stolen children are counted in pending, and their parents resumed
+    void check_fib() {
+      static constexpr
+      int n = 20;
+      long nb_steals = 0;
+      for (int nb_workers = 1; nb_workers <= 4; nb_workers++) {
+        nb_constructed.store(0);
+        nb_destructed.store(0);
+        nb_joined.store(0);
+        long r = -1;
+        auto st = launch<fib>(stealing_config(nb_workers), n, &r);
+        assert(r == fib_seq(n));
+        assert(nb_joined.load() == nb_inner(n));
+        assert(nb_destructed.load() == nb_constructed.load());
+        nb_steals += st.nb_steals;
+      }
+      assert(nb_steals > 0);
+    }
+
+    /* Thieves take up to max_nb_marks_per_steal stacks at once, the
+     * ones but the last going to their ready deque, from which other
+     * thieves may take them in turn. Each stack forked off is joined
+     * back once: each frame resumes once from its sync, after both
+     * of its children finished.
+     */
+    void check_multi_steal() {
+      static constexpr
+      int n = 22;
+      long nb_steals = 0;
+      for (int round = 0; round < 30; round++) {
+        nb_constructed.store(0);
+        nb_destructed.store(0);
+        nb_joined.store(0);
+        auto c = stealing_config(2 + round % 3);
+        c.max_nb_marks_per_steal = 2 << (round % 3);
+        long r = -1;
+        auto st = launch<fib>(c, n, &r);
+        assert(r == fib_seq(n));
+        assert(nb_joined.load() == nb_inner(n));
+        assert(nb_constructed.load() == 2 * nb_inner(n) + 1);
+        assert(nb_destructed.load() == nb_constructed.load());
+        nb_steals += st.nb_steals;
+      }
+      assert(nb_steals > 0);
+    }
+
+    // each iteration runs once, in whichever piece it was split into
+    void check_loop() {
+      static constexpr
+      size_t n = 100000;
+      std::vector<std::atomic<int>> counts(n);
+      long nb_splits = 0;
+      for (int nb_workers = 1; nb_workers <= 4; nb_workers++) {
+        for (auto& c : counts) {
+          c.store(0);
+        }
+        nb_constructed.store(0);
+        nb_destructed.store(0);
+        auto st = launch<visit>(stealing_config(nb_workers), 0, n, counts.data());
+        for (auto& c : counts) {
+          assert(c.load() == 1);
+        }
+        assert(nb_constructed.load() == st.nb_splits + 1);
+        assert(nb_destructed.load() == nb_constructed.load());
+        nb_splits += st.nb_splits;
+      }
+      assert(nb_splits > 0);
+    }
+
+    /* Workers that find nothing to steal park for as long as the
+     * timeout, and only a wake-up by the spawns lets them steal
+     * before the computation is over. A hang is reported by the
+     * alarm.
+     */
+    void check_park() {
+      static constexpr
+      int nb_children = 8;
+      alarm(60);
+      for (int nb_workers = 2; nb_workers <= 4; nb_workers++) {
+        nb_constructed.store(0);
+        nb_destructed.store(0);
+        auto c = stealing_config(nb_workers);
+        c.park_threshold = 1;
+        c.park_timeout = 10 * 1000 * 1000;
+        auto start = std::chrono::steady_clock::now();
+        auto st = launch<sleeper>(c, 20, nb_children);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        assert(st.nb_parks > 0);
+        assert(st.nb_steals > 0);
+        assert(elapsed.count() < 10.0);
+        assert(nb_constructed.load() == nb_children + 1);
+        assert(nb_destructed.load() == nb_constructed.load());
+      }
+      alarm(0);
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  cactus_stack::runtime::check_fib();
+  cactus_stack::runtime::check_multi_steal();
+  cactus_stack::runtime::check_loop();
+  cactus_stack::runtime::check_park();
+  std::cout << "OK, runtime" << std::endl;
+  return 0;
+}
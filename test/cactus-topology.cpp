@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2017 Deepsea
+ *
+ * This software may be modified and distributed under
+ * the terms of the MIT license.  See the LICENSE file
+ * for details.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <set>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include "cactus-runtime.hpp"
+
+namespace cactus_stack {
+  namespace runtime {
+
+    namespace {
+
+      static constexpr
+      int nb_cpus = 16;
+
+      void make_dir(const std::string& path) {
+        int r = mkdir(path.c_str(), 0755);
+        assert((r == 0) || (errno == EEXIST));
+        (void)r;
+      }
+
+      void write_file(const std::string& path, const std::string& line) {
+        std::ofstream f(path);
+        f << line << std::endl;
+        assert(f.good());
+      }
+
+      std::string cpu_list(int a, int b) {
+        return std::to_string(a) + "," + std::to_string(b);
+      }
+
+      /* Writes the sysfs tree of a machine with two sockets, each
+       * with two last-level caches, each shared by two cores of two
+       * SMT threads. As on x86, cpu c and cpu c + 8 are the threads
+       * of a core. With caches false, the tree has no cache
+       * directories, as on some virtual machines.
+       */
+      std::string make_sysfs(bool caches) {
+        char tmpl[] = "/tmp/cactus-topology-XXXXXX";
+        char* root = mkdtemp(tmpl);
+        assert(root != nullptr);
+        for (int c = 0; c < nb_cpus; c++) {
+          int k = c % 8;
+          std::string dir = std::string(root) + "/cpu" + std::to_string(c);
+          make_dir(dir);
+          make_dir(dir + "/topology");
+          write_file(dir + "/topology/physical_package_id", std::to_string(k / 4));
+          write_file(dir + "/topology/thread_siblings_list", cpu_list(k, k + 8));
+          if (! caches) {
+            continue;
+          }
+          make_dir(dir + "/cache");
+          int a = 2 * (k / 2);
+          std::string shared[] = {
+            cpu_list(k, k + 8), cpu_list(k, k + 8), cpu_list(k, k + 8),
+            std::to_string(a) + "-" + std::to_string(a + 1) + "," +
+            std::to_string(a + 8) + "-" + std::to_string(a + 9)
+          };
+          int level[] = { 1, 1, 2, 3 };
+          for (int i = 0; i < 4; i++) {
+            std::string index = dir + "/cache/index" + std::to_string(i);
+            make_dir(index);
+            write_file(index + "/level", std::to_string(level[i]));
+            write_file(index + "/shared_cpu_list", shared[i]);
+          }
+        }
+        return root;
+      }
+
+      void remove_sysfs(const std::string& root) {
+        std::string cmd = "rm -rf " + root;
+        int r = system(cmd.c_str());
+        assert(r == 0);
+        (void)r;
+      }
+
+      std::set<int> as_set(const std::vector<int>& vs) {
+        return std::set<int>(vs.begin(), vs.end());
+      }
+
+      long fib_seq(int n) {
+        return (n < 2) ? n : fib_seq(n - 1) + fib_seq(n - 2);
+      }
+
+      class fib : public frame {
+      public:
+
+        int n;
+
+        long* dst;
+
+        long a, b;
+
+        int state = 0;
+
+        fib(int n, long* dst) : n(n), dst(dst) { }
+
+        void run(worker& w) override {
+          switch (state) {
+            case 0: {
+              if (n < 2) {
+                *dst = n;
+                w.finish();
+                return;
+              }
+              state = 1;
+              w.spawn<fib>(n - 1, &a);
+              return;
+            }
+            case 1: {
+              state = 2;
+              w.call<fib>(n - 2, &b);
+              return;
+            }
+            case 2: {
+              state = 3;
+              w.sync();
+              return;
+            }
+            case 3: {
+              *dst = a + b;
+              w.finish();
+              return;
+            }
+          }
+        }
+
+      };
+
+    } // end namespace
+
+    // cores, last-level caches and sockets are told apart
+    void check_read(const std::string& root) {
+      auto t = read_cpu_topology(root);
+      assert(t.nb_cpus() == nb_cpus);
+      for (int c = 0; c < nb_cpus; c++) {
+        assert(t.core[c] == c % 8);
+        assert(t.llc[c] == 2 * ((c % 8) / 2));
+        assert(t.package[c] == (c % 8) / 4);
+      }
+      assert(t.level(0, 8) == Level_smt);
+      assert(t.level(0, 1) == Level_llc);
+      assert(t.level(0, 9) == Level_llc);
+      assert(t.level(0, 2) == Level_socket);
+      assert(t.level(0, 11) == Level_socket);
+      assert(t.level(0, 4) == Level_remote);
+      assert(t.level(0, 15) == Level_remote);
+      assert(t.level(3, 10) == Level_llc);
+    }
+
+    // with no cache directories, each core has a last-level cache of its own
+    void check_read_no_caches(const std::string& root) {
+      auto t = read_cpu_topology(root);
+      assert(t.nb_cpus() == nb_cpus);
+      assert(t.level(0, 8) == Level_smt);
+      assert(t.level(0, 1) == Level_socket);
+      assert(t.level(0, 4) == Level_remote);
+    }
+
+    // a missing tree gives an empty topology, and all victims are remote
+    void check_read_missing() {
+      auto t = read_cpu_topology("/nonexistent");
+      assert(t.nb_cpus() == 0);
+      victim_selector sel(1);
+      add_victims(sel, 0, 4, t);
+      for (int l = 0; l < Level_remote; l++) {
+        assert(sel.victims[l].empty());
+      }
+      assert(as_set(sel.victims[Level_remote]) == std::set<int>({ 1, 2, 3 }));
+    }
+
+    // the SMT sibling comes first, then the last-level cache, then the socket
+    void check_victims(const std::string& root) {
+      auto t = read_cpu_topology(root);
+      victim_selector sel(1);
+      add_victims(sel, 0, nb_cpus, t);
+      assert(as_set(sel.victims[Level_smt]) == std::set<int>({ 8 }));
+      assert(as_set(sel.victims[Level_llc]) == std::set<int>({ 1, 9 }));
+      assert(as_set(sel.victims[Level_socket]) == std::set<int>({ 2, 3, 10, 11 }));
+      assert(as_set(sel.victims[Level_remote]) == std::set<int>({ 4, 5, 6, 7, 12, 13, 14, 15 }));
+      // with more workers than cpus, worker j runs on cpu j modulo 16
+      victim_selector sel2(1);
+      add_victims(sel2, 0, nb_cpus + 1, t);
+      assert(as_set(sel2.victims[Level_smt]) == std::set<int>({ 8, 16 }));
+    }
+
+    // a thief moves on to the next level after threshold[level] failures
+    // in a row, stays at the last one, and comes back to the first one
+    // once it steals
+    void check_escalation(const std::string& root) {
+      auto t = read_cpu_topology(root);
+      auto c = default_config();
+      const int* threshold = c.escalation_threshold;
+      victim_selector sel(1);
+      add_victims(sel, 0, nb_cpus, t);
+      long nb_steals_at_level[nb_topology_levels] = { 0 };
+      for (int round = 0; round < 3; round++) {
+        for (int l = 0; l < nb_topology_levels; l++) {
+          for (int i = 0; i < threshold[l]; i++) {
+            assert(sel.level == l);
+            int v = sel.random_victim();
+            assert(t.level(0, v) == l);
+            sel.failed(threshold);
+          }
+        }
+        assert(sel.level == Level_remote);
+        int v = sel.random_victim();
+        assert(t.level(0, v) == Level_remote);
+        nb_steals_at_level[sel.succeeded()]++;
+        assert(sel.level == Level_smt);
+        assert(sel.nb_failed == 0);
+        // a steal at the first attempt
+        v = sel.random_victim();
+        assert(v == 8);
+        nb_steals_at_level[sel.succeeded()]++;
+      }
+      assert(nb_steals_at_level[Level_smt] == 3);
+      assert(nb_steals_at_level[Level_llc] == 0);
+      assert(nb_steals_at_level[Level_socket] == 0);
+      assert(nb_steals_at_level[Level_remote] == 3);
+    }
+
+    // levels without victims are skipped
+    void check_skip_empty(const std::string& root) {
+      auto t = read_cpu_topology(root);
+      victim_selector sel(1);
+      // worker 0 and the workers on its socket, but not its SMT sibling
+      add_victims(sel, 0, 4, t);
+      assert(sel.victims[Level_smt].empty());
+      int v = sel.random_victim();
+      assert(t.level(0, v) == Level_llc);
+      assert(sel.level == Level_llc);
+    }
+
+    // each steal is counted at one level
+    void check_launch(const std::string& root) {
+      static constexpr
+      int n = 20;
+      long nb_steals = 0;
+      for (int nb_workers = 2; nb_workers <= 4; nb_workers++) {
+        auto c = default_config();
+        c.nb_workers = nb_workers;
+        c.polling_interval = 1;
+        c.victim_selection = Victim_hierarchical;
+        c.topology_root = root;
+        long r = -1;
+        auto st = launch<fib>(c, n, &r);
+        assert(r == fib_seq(n));
+        long nb = 0;
+        for (int l = 0; l < nb_topology_levels; l++) {
+          nb += st.nb_steals_at_level[l];
+        }
+        assert(nb == st.nb_steals + st.nb_splits);
+        // the first 4 cpus share a socket, and no two share a core
+        assert(st.nb_steals_at_level[Level_smt] == 0);
+        assert(st.nb_steals_at_level[Level_remote] == 0);
+        nb_steals += nb;
+      }
+      assert(nb_steals > 0);
+    }
+
+  } // end namespace
+} // end namespace
+
+int main() {
+  using namespace cactus_stack::runtime;
+  std::string root = make_sysfs(true);
+  std::string root_no_caches = make_sysfs(false);
+  check_read(root);
+  check_read_no_caches(root_no_caches);
+  check_read_missing();
+  check_victims(root);
+  check_escalation(root);
+  check_skip_empty(root);
+  check_launch(root);
+  remove_sysfs(root);
+  remove_sysfs(root_no_caches);
+  std::cout << "OK, topology" << std::endl;
+  return 0;
+}